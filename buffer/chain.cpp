@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <vector>
+
+#include "chain.h"
+
+OOLONG_NS_BEGIN
+
+BufferChain::BufferChain()
+    : m_off(0),
+      m_size(0),
+      m_tail(NULL)
+{
+}
+
+size_t BufferChain::Size() const
+{
+    return m_size;
+}
+
+bool BufferChain::Empty() const
+{
+    return (m_size == 0);
+}
+
+void BufferChain::Append(const char *data, size_t n)
+{
+    if (!n)
+        return;
+
+    if (m_tail &&
+        m_tail->size() + n <= PACK_SIZE)
+    {
+        m_tail->append(data, n);
+        m_size += n;
+        return;
+    }
+
+    auto s = std::make_shared<std::string>(data, n);
+
+    m_tail = s.get();
+    m_segs.emplace_back(std::move(s));
+    m_size += n;
+}
+
+void BufferChain::Append(std::string &&data)
+{
+    if (data.empty())
+        return;
+
+    if (data.size() <= PACK_SIZE / 4)
+    {
+        Append(data.data(), data.size());
+        return;
+    }
+
+    auto s = std::make_shared<std::string>(std::move(data));
+
+    m_size += s->size();
+    m_tail = s.get();
+    m_segs.emplace_back(std::move(s));
+}
+
+void BufferChain::Append(Segment seg)
+{
+    if (!seg || seg->empty())
+        return;
+
+    m_size += seg->size();
+    m_tail = NULL;
+    m_segs.emplace_back(std::move(seg));
+}
+
+int BufferChain::Fill(struct iovec *iov, int max) const
+{
+    int cnt = 0;
+
+    for (auto &s : m_segs)
+    {
+        if (cnt == max)
+            break;
+
+        size_t off = cnt ? 0 : m_off;
+
+        iov[cnt].iov_base = (void*) (s->data() + off);
+        iov[cnt].iov_len = s->size() - off;
+        ++cnt;
+    }
+
+    return cnt;
+}
+
+std::shared_ptr<void> BufferChain::Hold(int n)
+{
+    n = std::min<size_t>(n, m_segs.size());
+
+    auto held = std::make_shared<std::vector<Segment>>(m_segs.begin(),
+                                                       m_segs.begin() + n);
+
+    // no more packing into a held segment, it may move on growth
+    for (auto &s : *held)
+    {
+        if (s.get() == m_tail)
+            m_tail = NULL;
+    }
+
+    return held;
+}
+
+const char* BufferChain::Head() const
+{
+    if (m_segs.empty())
+        return NULL;
+
+    return m_segs.front()->data() + m_off;
+}
+
+size_t BufferChain::HeadSize() const
+{
+    if (m_segs.empty())
+        return 0;
+
+    return m_segs.front()->size() - m_off;
+}
+
+size_t BufferChain::Remove(size_t n)
+{
+    n = std::min(n, m_size);
+
+    size_t left = n;
+
+    while (left)
+    {
+        size_t avail = m_segs.front()->size() - m_off;
+
+        if (left < avail)
+        {
+            m_off += left;
+            break;
+        }
+
+        left -= avail;
+
+        if (m_segs.front().get() == m_tail)
+            m_tail = NULL;
+
+        m_segs.pop_front();
+        m_off = 0;
+    }
+
+    m_size -= n;
+    return n;
+}
+
+void BufferChain::Clear()
+{
+    m_segs.clear();
+    m_off = 0;
+    m_size = 0;
+    m_tail = NULL;
+}
+
+OOLONG_NS_END
@@ -0,0 +1,71 @@
+#ifndef OOLONG_CHAIN_H
+#define OOLONG_CHAIN_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <string>
+#include <deque>
+#include <memory>
+
+#include "oolong.h"
+
+OOLONG_NS_BEGIN
+
+// output queue of segments, written out with scatter io instead of
+// being copied together. grows as needed, segments are never modified
+// once queued so one may be shared by several chains
+class BufferChain
+{
+public:
+    typedef std::shared_ptr<const std::string> Segment;
+
+    BufferChain();
+
+    //num of queued bytes
+    size_t Size() const;
+
+    bool Empty() const;
+
+    //copy data, small ones are packed into the last segment
+    void Append(const char *data, size_t n);
+
+    //take data over
+    void Append(std::string &&data);
+
+    //queue a shared segment
+    void Append(Segment seg);
+
+    //iovecs over the first max segments, returns count
+    int Fill(struct iovec *iov, int max) const;
+
+    //keep the first n segments alive and unchanged, e.g. while the
+    //kernel still reads them after Fill()
+    std::shared_ptr<void> Hold(int n);
+
+    //first contiguous bytes
+    const char* Head() const;
+    size_t HeadSize() const;
+
+    //remove used data after Head() unused
+    size_t Remove(size_t n);
+
+    void Clear();
+
+private:
+    // copies up to this are packed together
+    enum { PACK_SIZE = 16 * 1024 };
+
+    std::deque<Segment> m_segs;
+
+    // sent part of the first segment
+    size_t m_off;
+
+    size_t m_size;
+
+    // last segment if we made it and nobody else holds it
+    std::string *m_tail;
+};
+
+OOLONG_NS_END
+
+#endif
@@ -0,0 +1,285 @@
+#ifndef OOLONG_FAIR_QUEUE_H
+#define OOLONG_FAIR_QUEUE_H
+
+#include <stddef.h>
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+
+#include "oolong.h"
+
+OOLONG_NS_BEGIN
+
+// items queued per flow (a connection, a tenant) and taken out by
+// deficit round robin: each turn a flow may hand out as many items as
+// its weight, so one flow with a long queue can't starve the others.
+// a flow may also be limited to a number of items in flight, counted
+// from Pop() to Done(). not thread-safe, the caller locks.
+template <typename T>
+class FairQueue
+{
+public:
+    FairQueue()
+        : m_size(0)
+    {
+    }
+
+    // weight >= 1, max_inflight 0 for no limit. unknown flows are
+    // added by Push() with weight 1 and no limit
+    void AddFlow(int flow, unsigned weight, unsigned max_inflight)
+    {
+        auto &f = m_flows[flow];
+
+        f.weight = std::max(weight, 1U);
+        f.max_inflight = max_inflight;
+        f.removed = false;
+    }
+
+    // the flow goes away once its queue is drained, Clear() it first
+    // to not wait for that
+    void RemoveFlow(int flow)
+    {
+        auto it = m_flows.find(flow);
+
+        if (it == m_flows.end())
+            return;
+
+        it->second.removed = true;
+        Reap(it);
+    }
+
+    void Push(int flow, T &&item)
+    {
+        auto &f = m_flows[flow];
+
+        f.q.push_back(std::move(item));
+        ++m_size;
+
+        Activate(flow, f);
+    }
+
+    // drop the items flow has queued, returns how many
+    size_t Clear(int flow)
+    {
+        auto it = m_flows.find(flow);
+
+        if (it == m_flows.end())
+            return 0;
+
+        auto &f = it->second;
+        size_t n = f.q.size();
+
+        f.q.clear();
+        m_size -= n;
+
+        Shrunk(flow, f);
+        return n;
+    }
+
+    // drop the first item of flow that pred matches, into *item
+    template <typename Pred>
+    bool Erase(int flow, Pred pred, T *item)
+    {
+        auto it = m_flows.find(flow);
+
+        if (it == m_flows.end())
+            return false;
+
+        auto &f = it->second;
+
+        for (auto q = f.q.begin(); q != f.q.end(); ++q)
+        {
+            if (!pred(*q))
+                continue;
+
+            *item = std::move(*q);
+
+            f.q.erase(q);
+            --m_size;
+
+            Shrunk(flow, f);
+            return true;
+        }
+
+        return false;
+    }
+
+    // next item of the flow whose turn it is
+    bool Pop(T *item, int *flow)
+    {
+        while (!m_active.empty())
+        {
+            int id = m_active.front();
+            auto &f = m_flows[id];
+
+            if (f.fresh)
+            {
+                // start of its turn
+                f.deficit += f.weight;
+                f.fresh = false;
+            }
+
+            if (f.deficit > 0 &&
+                Eligible(f))
+            {
+                *item = std::move(f.q.front());
+                *flow = id;
+
+                f.q.pop_front();
+                --f.deficit;
+                ++f.inflight;
+                --m_size;
+
+                if (!Eligible(f))
+                {
+                    m_active.pop_front();
+                    Deactivate(f);
+                }
+
+                return true;
+            }
+
+            // turn is over
+            m_active.pop_front();
+            f.fresh = true;
+
+            if (Eligible(f))
+                m_active.push_back(id);
+            else
+                Deactivate(f);
+        }
+
+        return false;
+    }
+
+    // an item of flow was handled. true if that let the flow go on
+    bool Done(int flow)
+    {
+        auto it = m_flows.find(flow);
+
+        if (it == m_flows.end())
+            return false;
+
+        auto &f = it->second;
+
+        if (f.inflight)
+            --f.inflight;
+
+        bool resumed = Activate(flow, f);
+
+        Reap(it);
+        return resumed;
+    }
+
+    // some flow may hand out an item
+    bool Ready() const
+    {
+        return !m_active.empty();
+    }
+
+    // items queued, including those of flows at their limit
+    size_t Size() const
+    {
+        return m_size;
+    }
+
+    bool Empty() const
+    {
+        return (m_size == 0);
+    }
+
+private:
+    struct Flow
+    {
+        Flow()
+            : weight(1),
+              max_inflight(0),
+              inflight(0),
+              deficit(0),
+              active(false),
+              fresh(true),
+              removed(false)
+        {
+        }
+
+        std::deque<T> q;
+
+        unsigned weight;
+        unsigned max_inflight;
+        unsigned inflight;
+
+        // items it may still hand out this turn
+        unsigned deficit;
+
+        // in m_active
+        bool active;
+
+        // its turn hasn't started yet
+        bool fresh;
+
+        bool removed;
+    };
+
+    typedef typename std::unordered_map<int, Flow>::iterator FlowIter;
+
+    bool Eligible(const Flow &f) const
+    {
+        return (!f.q.empty() &&
+                (!f.max_inflight || f.inflight < f.max_inflight));
+    }
+
+    bool Activate(int flow, Flow &f)
+    {
+        if (f.active || !Eligible(f))
+            return false;
+
+        f.active = true;
+        f.fresh = true;
+        m_active.push_back(flow);
+
+        return true;
+    }
+
+    void Deactivate(Flow &f)
+    {
+        // an idle flow doesn't save up credit
+        f.active = false;
+        f.fresh = true;
+        f.deficit = 0;
+    }
+
+    // items were taken out of turn, Ready() must stay true only while
+    // Pop() has something to give
+    void Shrunk(int flow, Flow &f)
+    {
+        if (!f.active || Eligible(f))
+            return;
+
+        m_active.erase(std::find(m_active.begin(), m_active.end(), flow));
+        Deactivate(f);
+    }
+
+    void Reap(FlowIter it)
+    {
+        auto &f = it->second;
+
+        if (f.removed &&
+            f.q.empty() &&
+            !f.inflight &&
+            !f.active)
+        {
+            m_flows.erase(it);
+        }
+    }
+
+    std::unordered_map<int, Flow> m_flows;
+
+    // flows with items to hand out, in turn order
+    std::deque<int> m_active;
+
+    size_t m_size;
+};
+
+OOLONG_NS_END
+
+#endif
@@ -0,0 +1,197 @@
+#include <chrono>
+#include <functional>
+
+#include "result_cache.h"
+
+OOLONG_NS_BEGIN
+
+static uint64_t NowMS()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static size_t Cost(const std::string &key, const std::string &result)
+{
+    // both live in the entry and the key once more in the index
+    return 2 * key.size() + result.size();
+}
+
+ResultCache::ResultCache(size_t capacity)
+    : m_shard_capacity(capacity / SHARDS),
+      m_epoch(0)
+{
+}
+
+void ResultCache::SetCapacity(size_t capacity)
+{
+    m_shard_capacity = capacity / SHARDS;
+
+    // shrink lazily, on the next Put of each shard
+}
+
+std::string ResultCache::Key(const std::string &method,
+                             const nlohmann::json &params)
+{
+    std::string key = method;
+
+    key += '\0';
+    key += params.dump();
+
+    return key;
+}
+
+ResultCache::Shard& ResultCache::ShardOf(const std::string &key)
+{
+    return m_shards[std::hash<std::string>()(key) % SHARDS];
+}
+
+ResultCache::Result ResultCache::Get(const std::string &key)
+{
+    auto &s = ShardOf(key);
+
+    std::unique_lock<std::mutex>
+        lock(s.lock);
+
+    auto it = s.index.find(key);
+
+    if (it == s.index.end())
+        return nullptr;
+
+    auto e = it->second;
+
+    if (e->expires &&
+        e->expires <= NowMS())
+    {
+        Drop(s, e);
+        return nullptr;
+    }
+
+    s.lru.splice(s.lru.begin(), s.lru, e);
+    return e->result;
+}
+
+void ResultCache::Put(const std::string &key,
+                      Result r,
+                      long ttl,
+                      uint64_t epoch)
+{
+    if (!r || !ttl)
+        return;
+
+    size_t cost = Cost(key, *r);
+    size_t capacity = m_shard_capacity;
+
+    if (cost > capacity)
+        return;
+
+    auto &s = ShardOf(key);
+
+    std::unique_lock<std::mutex>
+        lock(s.lock);
+
+    // checked under the lock, Invalidate() bumps it under the lock
+    if (epoch != m_epoch)
+        return;
+
+    auto it = s.index.find(key);
+
+    if (it != s.index.end())
+        Drop(s, it->second);
+
+    while (!s.lru.empty() &&
+           s.size + cost > capacity)
+    {
+        Drop(s, std::prev(s.lru.end()));
+    }
+
+    s.lru.push_front(Entry { key, std::move(r),
+                             (ttl > 0) ? NowMS() + ttl : 0 });
+
+    s.index.emplace(key, s.lru.begin());
+    s.size += cost;
+}
+
+uint64_t ResultCache::Epoch() const
+{
+    return m_epoch;
+}
+
+void ResultCache::Invalidate(const std::string &key)
+{
+    auto &s = ShardOf(key);
+
+    std::unique_lock<std::mutex>
+        lock(s.lock);
+
+    ++m_epoch;
+
+    auto it = s.index.find(key);
+
+    if (it != s.index.end())
+        Drop(s, it->second);
+}
+
+void ResultCache::InvalidateMethod(const std::string &method)
+{
+    std::string prefix = method;
+
+    prefix += '\0';
+
+    for (auto &s : m_shards)
+    {
+        std::unique_lock<std::mutex>
+            lock(s.lock);
+
+        ++m_epoch;
+
+        for (auto it = s.lru.begin(); it != s.lru.end(); )
+        {
+            auto next = std::next(it);
+
+            if (!it->key.compare(0, prefix.size(), prefix))
+                Drop(s, it);
+
+            it = next;
+        }
+    }
+}
+
+void ResultCache::Clear()
+{
+    for (auto &s : m_shards)
+    {
+        std::unique_lock<std::mutex>
+            lock(s.lock);
+
+        ++m_epoch;
+
+        s.index.clear();
+        s.lru.clear();
+        s.size = 0;
+    }
+}
+
+size_t ResultCache::Size()
+{
+    size_t n = 0;
+
+    for (auto &s : m_shards)
+    {
+        std::unique_lock<std::mutex>
+            lock(s.lock);
+
+        n += s.size;
+    }
+
+    return n;
+}
+
+void ResultCache::Drop(Shard &s, std::list<Entry>::iterator it)
+{
+    s.size -= Cost(it->key, *it->result);
+    s.index.erase(it->key);
+    s.lru.erase(it);
+}
+
+OOLONG_NS_END
@@ -0,0 +1,97 @@
+#ifndef OOLONG_RESULT_CACHE_H
+#define OOLONG_RESULT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+#include "oolong.h"
+#include "json.hpp"
+
+OOLONG_NS_BEGIN
+
+// serialized results of idempotent methods by method and params.
+// bounded in bytes, least recently used go first. split in shards
+// so workers and the loop don't all wait on one lock
+class ResultCache
+{
+public:
+    typedef std::shared_ptr<const std::string> Result;
+
+    ResultCache(size_t capacity = 64 << 20);
+
+    // bytes for keys and results, entries over it are evicted
+    void SetCapacity(size_t capacity);
+
+    // the same for equal params, json objects dump with sorted keys
+    static std::string Key(const std::string &method,
+                           const nlohmann::json &params);
+
+    // NULL if missing or expired
+    Result Get(const std::string &key);
+
+    // ttl millisec, < 0 until invalidated or evicted. dropped if
+    // anything was invalidated since epoch was taken, the result may
+    // predate it
+    void Put(const std::string &key, Result r, long ttl, uint64_t epoch);
+
+    // take before computing a result to Put()
+    uint64_t Epoch() const;
+
+    void Invalidate(const std::string &key);
+
+    // every entry of method
+    void InvalidateMethod(const std::string &method);
+
+    void Clear();
+
+    // bytes in use
+    size_t Size();
+
+private:
+    enum
+    {
+        SHARDS = 16,
+    };
+
+    struct Entry
+    {
+        std::string key;
+        Result result;
+
+        // steady clock millisec, 0 never
+        uint64_t expires;
+    };
+
+    struct Shard
+    {
+        Shard() : size(0) {}
+
+        std::mutex lock;
+
+        // most recently used first
+        std::list<Entry> lru;
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+
+        size_t size;
+    };
+
+    Shard& ShardOf(const std::string &key);
+
+    // under s.lock
+    void Drop(Shard &s, std::list<Entry>::iterator it);
+
+    Shard m_shards[SHARDS];
+
+    std::atomic<size_t> m_shard_capacity;
+    std::atomic<uint64_t> m_epoch;
+};
+
+OOLONG_NS_END
+
+#endif
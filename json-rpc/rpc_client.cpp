@@ -5,14 +5,52 @@
 #include <string.h>
 #include <string>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
 
 #include "rpc_client.h"
+#include "unix_addr.h"
+#include "shm_channel.h"
 
 #define DLOG(fmt, ...) \
     fprintf(stderr, fmt "\n", ##__VA_ARGS__);
 
+// polls of the ring before sleeping on the doorbell
+static const int kShmSpin = 2000;
+
+// the length prefix is 16 bits
+static const size_t kMaxPayload = 0xFFFF;
+
+static long NowMS()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ts.tv_sec * 1000) +
+           (ts.tv_nsec / 1000000);
+}
+
+// prepend the length, -1 with EMSGSIZE if it does not fit
+static int MakeFrame(std::string &s)
+{
+    if (s.size() > kMaxPayload)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    uint16_t datalen = htons(s.size());
+
+    s.insert(0, (char*) &datalen, 2);
+
+    return 0;
+}
+
 inline nlohmann::json
-MakeRequest(int id, const char *method,
+MakeRequest(uint64_t id, const char *method,
             const nlohmann::json &params)
 {
     return nlohmann::json(
@@ -44,10 +82,7 @@ RPCClient::RPCClient()
 
 RPCClient::~RPCClient()
 {
-    if (m_socket >= 0)
-    {
-        close(m_socket);
-    }
+    Close();
 }
 
 int RPCClient::DataLength()
@@ -66,6 +101,58 @@ const char* RPCClient::Data()
     return &m_buffer[2];
 }
 
+bool RPCClient::Connected() const
+{
+    return (m_socket >= 0);
+}
+
+int RPCClient::Fd() const
+{
+    return m_socket;
+}
+
+bool RPCClient::Healthy() const
+{
+    if (m_socket < 0)
+        return false;
+
+    struct pollfd pfd;
+
+    pfd.fd = m_socket;
+    pfd.events = POLLIN | POLLRDHUP;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, 0) < 0)
+        return false;
+
+    return (pfd.revents == 0 &&
+            m_pending.empty());
+}
+
+void RPCClient::Close()
+{
+    StopBatching();
+    StopFlusher();
+
+    m_shm.reset();
+
+    if (m_socket >= 0)
+    {
+        close(m_socket);
+        m_socket = -1;
+    }
+
+    m_buffer.clear();
+    m_pending.clear();
+
+    std::unique_lock<std::mutex>
+        lock(m_queue_lock);
+
+    m_queue.clear();
+    m_queued = 0;
+    m_flush_error = 0;
+}
+
 int RPCClient::ConnectTCP(const char *host, int port)
 {
     struct addrinfo hints, *res;
@@ -84,11 +171,120 @@ int RPCClient::ConnectTCP(const char *host, int port)
         return -1;
     }
 
+    int rc = Connect(res->ai_addr, res->ai_addrlen);
+
+    freeaddrinfo(res);
+    return rc;
+}
+
+int RPCClient::ConnectUnix(const char *path)
+{
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+
+    if (!path ||
+        MakeUnixAddr(path, &addr, &addrlen) < 0)
+    {
+        DLOG("invalid unix path");
+        return -1;
+    }
+
+    return Connect((struct sockaddr*) &addr, addrlen);
+}
+
+int RPCClient::ConnectShm(const char *path)
+{
+    if (ConnectUnix(path) < 0)
+        return -1;
+
+    nlohmann::json param = nlohmann::json::object();
+
+    if (Send("$/shm", param) < 0)
+    {
+        Close();
+        return -1;
+    }
+
+    int fds[ShmChannel::FD_NUM];
+    char tmp[1024];
+
+    // the fds ride along with the first bytes of the reply
+    int rc = ShmChannel::RecvFds(m_socket, tmp, sizeof(tmp), fds);
+
+    std::unique_ptr<ShmChannel> shm(
+        new (std::nothrow) ShmChannel(ShmChannel::CLIENT));
+
+    do
+    {
+        if (rc <= 0 || !shm)
+            break;
+
+        m_buffer.assign(tmp, tmp + rc);
+
+        while (m_buffer.size() < 2 ||
+               m_buffer.size() < (size_t) (ntohs(*(uint16_t*) m_buffer.data()) + 2))
+        {
+            rc = recv(m_socket, tmp, sizeof(tmp), 0);
+
+            if (rc <= 0)
+                break;
+
+            m_buffer.insert(m_buffer.end(), tmp, tmp + rc);
+        }
+
+        if (rc <= 0)
+            break;
+
+        size_t ring = 0;
+
+        try
+        {
+            auto resp = nlohmann::json::parse(
+                            std::string(Data(), DataLength()));
+
+            ring = resp.at("result").at("ring");
+        }
+        catch (nlohmann::json::exception &e)
+        {
+            DLOG("shm handshake rejected");
+            break;
+        }
+
+        if (shm->Attach(fds, ring) < 0)
+        {
+            // fds are closed by the channel
+            shm.reset();
+            Close();
+            return -1;
+        }
+
+        m_shm = std::move(shm);
+        m_buffer.clear();
+        return 0;
+
+    } while (0);
+
+    for (auto fd : fds)
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    Close();
+
+    errno = EPROTO;
+    return -1;
+}
+
+int RPCClient::Connect(const struct sockaddr *addr, socklen_t addrlen)
+{
+    Close();
+
     do
     {
-        m_socket = socket(res->ai_family,
-                          res->ai_socktype,
-                          res->ai_protocol);
+        m_socket = socket(addr->sa_family,
+                          SOCK_STREAM,
+                          0);
 
         if (m_socket < 0)
         {
@@ -97,137 +293,866 @@ int RPCClient::ConnectTCP(const char *host, int port)
         }
 
         if (connect(m_socket,
-                    res->ai_addr,
-                    res->ai_addrlen) < 0)
+                    addr,
+                    addrlen) < 0)
         {
             DLOG("connect failed");
             break;
         }
 
-        freeaddrinfo(res);
         return 0;
 
     } while (0);
 
-    if (m_socket >= 0)
-    {
-        close(m_socket);
-        m_socket = -1;
-    }
+    int err = errno;
 
-    freeaddrinfo(res);
+    Close();
+
+    errno = err;
     return -1;
 }
 
-int RPCClient::Send(const char *method, nlohmann::json &param)
+void RPCClient::SetTimeout(long timeout)
+{
+    m_timeout = timeout;
+}
+
+int RPCClient::Send(const char *method,
+                    nlohmann::json &param,
+                    uint64_t id)
 {
     if (m_socket < 0)
         return -1;
 
-    nlohmann::json req = MakeRequest(1,
+    nlohmann::json req = MakeRequest(id,
                                      method,
                                      param);
 
+    // relative, our clock means nothing to the server
+    if (m_timeout > 0)
+        req["timeout"] = m_timeout;
+
     std::string s = req.dump();
-    uint16_t datalen = htons(s.size());
 
-    s.insert(0, (char*) &datalen, 2);
+    if (MakeFrame(s) < 0)
+        return -1;
+
+    // notifications issued before go first
+    if (Flush() < 0)
+        return -1;
+
+    std::unique_lock<std::mutex>
+        lock(m_write_lock);
+
+    if (m_shm)
+        return SendShm(s);
 
-    return send(m_socket, s.c_str(), s.size(), 0);
+    return send(m_socket, s.c_str(), s.size(), MSG_NOSIGNAL);
 }
 
-int RPCClient::Recv(long timeout)
+int RPCClient::Notify(const char *method, const nlohmann::json &params)
 {
     if (m_socket < 0)
+    {
+        errno = ENOTCONN;
         return -1;
+    }
 
-    m_buffer.clear();
+    std::string s = MakeNotification(method, params).dump();
 
-    struct timeval tv, *ptv = NULL;
-    struct timeval now;
+    if (MakeFrame(s) < 0)
+        return -1;
 
-    fd_set rfds;
-    long start = 0;
+    bool background;
 
-    if (timeout <= 0)
     {
-        tv.tv_sec = 0;
-        tv.tv_usec = 1000; // 1 millsec
-        ptv = &tv;
+        std::unique_lock<std::mutex>
+            lock(m_queue_lock);
+
+        if (m_flush_error)
+        {
+            errno = m_flush_error;
+            return -1;
+        }
+
+        background = m_flushing;
+
+        if (background &&
+            m_queued + s.size() > m_limit)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        m_queued += s.size();
+        m_queue.push_back(std::move(s));
+
+        // the flusher only waits for the first
+        if (background &&
+            m_queue.size() == 1)
+        {
+            m_flush_cond.notify_one();
+        }
     }
 
-    gettimeofday(&now, NULL);
+    if (background)
+        return 0;
+
+    return Flush(false);
+}
+
+int RPCClient::Flush()
+{
+    return Flush(true);
+}
 
-    start = (now.tv_sec * 1000) +
-            (now.tv_usec / 1000);
+int RPCClient::Flush(bool wait)
+{
+    std::vector<std::string> frames;
 
     while (1)
     {
-        FD_ZERO(&rfds);
-        FD_SET(m_socket, &rfds);
+        std::unique_lock<std::mutex>
+            writing(m_write_lock, std::defer_lock);
 
-        int rc = select(m_socket + 1,
-                        &rfds,
-                        NULL,
-                        NULL,
-                        ptv);
+        if (wait)
+            writing.lock();
+        else if (!writing.try_lock())
+            return 0;
 
-        if (rc < 0)
+        // the writer picks up what was queued meanwhile
+        while (1)
         {
-            return -1;
+            {
+                std::unique_lock<std::mutex>
+                    lock(m_queue_lock);
+
+                if (m_queue.empty())
+                    break;
+
+                frames.swap(m_queue);
+                m_queued = 0;
+            }
+
+            if (WriteFrames(frames) < 0)
+                return -1;
+
+            frames.clear();
         }
-        else if (!rc)
+
+        writing.unlock();
+
+        // one queued after our last look, by a Notify() that found us
+        // writing and left it to us
+        std::unique_lock<std::mutex>
+            lock(m_queue_lock);
+
+        if (m_queue.empty())
+            return 0;
+
+        wait = false;
+    }
+}
+
+int RPCClient::WriteFrames(std::vector<std::string> &frames)
+{
+    if (m_socket < 0)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if (m_shm)
+    {
+        for (auto &f : frames)
         {
-            long cur = 0;
+            if (SendShm(f) < 0)
+                return -1;
+        }
 
-            gettimeofday(&now, NULL);
+        return 0;
+    }
 
-            cur = (now.tv_sec * 1000) +
-                  (now.tv_usec / 1000);
+    struct iovec iov[IOV_MAX];
+    size_t next = 0;
 
-            if ((cur - start) < timeout)
-                continue;
+    // bytes of frames[next] already written
+    size_t off = 0;
 
-            // timeout
-            errno = ETIME;
-            return -1;
+    while (next < frames.size())
+    {
+        int n = 0;
+
+        for (size_t i = next; i < frames.size() && n < IOV_MAX; ++i, ++n)
+        {
+            size_t skip = (i == next) ? off : 0;
+
+            iov[n].iov_base = (char*) frames[i].data() + skip;
+            iov[n].iov_len = frames[i].size() - skip;
         }
 
-        char tmp[1024];
-        rc = recv(m_socket, tmp, 1024, 0);
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+
+        ssize_t rc = sendmsg(m_socket, &msg, MSG_NOSIGNAL);
 
         if (rc < 0)
         {
-            // read error
+            if (errno == EINTR)
+                continue;
+
             return -1;
         }
 
-        if (rc == 0)
+        // skip what went out, possibly ending mid frame
+        off += rc;
+
+        while (next < frames.size() &&
+               off >= frames[next].size())
         {
-            // connection close
-            errno = ECONNRESET;
-            return -1;
+            off -= frames[next].size();
+            ++next;
         }
+    }
 
-        m_buffer.insert(m_buffer.end(),
-                        tmp, tmp + rc);
+    return 0;
+}
+
+int RPCClient::StartFlusher(long linger, size_t limit)
+{
+    if (m_socket < 0 || m_shm || !limit)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    std::unique_lock<std::mutex>
+        lock(m_queue_lock);
+
+    if (m_flushing)
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+    m_flushing = true;
+    m_linger = linger;
+    m_limit = limit;
+    m_flusher = std::thread(&RPCClient::FlushLoop, this);
+
+    return 0;
+}
+
+void RPCClient::StopFlusher()
+{
+    {
+        std::unique_lock<std::mutex>
+            lock(m_queue_lock);
+
+        if (!m_flushing)
+            return;
+
+        m_flushing = false;
+        m_flush_cond.notify_one();
+    }
+
+    m_flusher.join();
+
+    // queued after the flusher's last round
+    Flush();
+}
+
+void RPCClient::FlushLoop()
+{
+    std::unique_lock<std::mutex>
+        lock(m_queue_lock);
 
-        if (m_buffer.size() < 2)
+    while (m_flushing)
+    {
+        if (m_queue.empty())
         {
-            // no header
+            m_flush_cond.wait(lock);
             continue;
         }
 
-        uint16_t datalen = ntohs(*(uint16_t*) m_buffer.data()); 
+        // let more join the first
+        if (m_linger > 0)
+        {
+            m_flush_cond.wait_for(lock,
+                                  std::chrono::microseconds(m_linger),
+                                  [this]
+                                  {
+                                      return (!m_flushing ||
+                                              (m_batch_max &&
+                                               m_queue.size() >= m_batch_max));
+                                  });
+        }
+
+        lock.unlock();
+
+        int rc = Flush(true);
+        int err = errno;
 
-        if (m_buffer.size() < (datalen + 2))
+        lock.lock();
+
+        if (rc < 0)
         {
-            // not enuf
-            continue;
+            // fails the producers from now on
+            m_flush_error = err;
+            m_queue.clear();
+            m_queued = 0;
+
+            // their requests are lost
+            lock.unlock();
+            FailCalls(err);
+            lock.lock();
         }
+    }
+}
+
+int RPCClient::StartBatching(long window, size_t max)
+{
+    if (m_socket < 0 || m_shm || !max)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (m_reading)
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+    {
+        std::unique_lock<std::mutex>
+            lock(m_queue_lock);
+
+        m_batch_max = max;
+        m_batch_linger = m_linger;
+        m_linger = window;
+    }
+
+    // shared with Notify(), if it runs already
+    m_batch_flusher = (StartFlusher(window) == 0);
+
+    if (!m_batch_flusher &&
+        errno != EEXIST)
+    {
+        return -1;
+    }
+
+    {
+        std::unique_lock<std::mutex>
+            lock(m_call_lock);
 
-        // got everything
-        break;
+        m_read_error = 0;
+    }
+
+    m_reading = true;
+    m_reader = std::thread(&RPCClient::ReadLoop, this);
+
+    return 0;
+}
+
+void RPCClient::StopBatching()
+{
+    if (!m_reading)
+        return;
+
+    // calls queued so far still go out. a flusher started with
+    // StartFlusher() is not ours to stop
+    if (m_batch_flusher)
+        StopFlusher();
+    else
+        Flush();
+
+    {
+        std::unique_lock<std::mutex>
+            lock(m_queue_lock);
+
+        m_batch_max = 0;
+
+        if (!m_batch_flusher)
+            m_linger = m_batch_linger;
+    }
+
+    m_batch_flusher = false;
+
+    m_reading = false;
+    m_reader.join();
+
+    FailCalls(ECANCELED);
+}
+
+int RPCClient::Call(const char *method,
+                    const nlohmann::json &params,
+                    nlohmann::json &response,
+                    long timeout)
+{
+    if (!m_reading)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (timeout <= 0)
+        timeout = m_timeout;
+
+    PendingCall call;
+    uint64_t id;
+
+    {
+        std::unique_lock<std::mutex>
+            lock(m_call_lock);
+
+        if (m_read_error)
+        {
+            errno = m_read_error;
+            return -1;
+        }
+
+        id = ++m_call_seq;
+        m_calls[id] = &call;
+    }
+
+    nlohmann::json req = MakeRequest(id, method, params);
+
+    if (timeout > 0)
+        req["timeout"] = timeout;
+
+    std::string s = req.dump();
+
+    if (MakeFrame(s) < 0)
+    {
+        int err = errno;
+
+        {
+            std::unique_lock<std::mutex>
+                lock(m_call_lock);
+
+            m_calls.erase(id);
+        }
+
+        errno = err;
+        return -1;
+    }
+
+    {
+        std::unique_lock<std::mutex>
+            lock(m_queue_lock);
+
+        m_queued += s.size();
+        m_queue.push_back(std::move(s));
+
+        // the first opens the window, max closes it
+        if (m_queue.size() == 1 ||
+            m_queue.size() == m_batch_max)
+        {
+            m_flush_cond.notify_one();
+        }
+    }
+
+    std::unique_lock<std::mutex>
+        lock(m_call_lock);
+
+    auto done = [&call] { return call.done; };
+
+    if (timeout > 0)
+        call.cond.wait_for(lock, std::chrono::milliseconds(timeout), done);
+    else
+        call.cond.wait(lock, done);
+
+    if (!call.done)
+    {
+        // a late response finds no one
+        m_calls.erase(id);
+
+        errno = ETIME;
+        return -1;
+    }
+
+    if (call.response.is_null())
+    {
+        errno = m_read_error ? m_read_error : ECONNRESET;
+        return -1;
+    }
+
+    response = std::move(call.response);
+    return 0;
+}
+
+void RPCClient::ReadLoop()
+{
+    // frames that came in before batching started
+    std::vector<char> in;
+
+    in.swap(m_pending);
+
+    char tmp[65536];
+
+    while (m_reading)
+    {
+        struct pollfd pfd;
+
+        pfd.fd = m_socket;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        // wakes up now and then to see if it should stop
+        int rc = poll(&pfd, 1, 100);
+
+        if (rc < 0 && errno == EINTR)
+            continue;
+
+        if (rc == 0)
+            continue;
+
+        ssize_t n = (rc < 0) ? -1 : recv(m_socket, tmp, sizeof(tmp), 0);
+
+        if (n <= 0)
+        {
+            FailCalls(n ? errno : ECONNRESET);
+            return;
+        }
+
+        in.insert(in.end(), tmp, tmp + n);
+
+        size_t off = 0;
+
+        while (in.size() - off >= 2)
+        {
+            size_t len = ntohs(*(uint16_t*) &in[off]) + 2;
+
+            if (in.size() - off < len)
+                break;
+
+            nlohmann::json resp = nlohmann::json::parse(in.begin() + off + 2,
+                                                        in.begin() + off + len,
+                                                        nullptr,
+                                                        false);
+
+            off += len;
+
+            // server notifications have none
+            auto id = resp.is_object() ? resp.find("id") : resp.end();
+
+            if (!resp.is_object() ||
+                id == resp.end() ||
+                !id->is_number_unsigned())
+            {
+                continue;
+            }
+
+            std::unique_lock<std::mutex>
+                lock(m_call_lock);
+
+            auto it = m_calls.find(id->get<uint64_t>());
+
+            if (it == m_calls.end())
+                continue;
+
+            it->second->response = std::move(resp);
+            it->second->done = true;
+            it->second->cond.notify_one();
+
+            m_calls.erase(it);
+        }
+
+        in.erase(in.begin(), in.begin() + off);
+    }
+}
+
+void RPCClient::FailCalls(int err)
+{
+    std::unique_lock<std::mutex>
+        lock(m_call_lock);
+
+    m_read_error = err;
+
+    for (auto &it : m_calls)
+    {
+        it.second->done = true;
+        it.second->cond.notify_one();
+    }
+
+    m_calls.clear();
+}
+
+int RPCClient::SendShm(const std::string &frame)
+{
+    size_t off = 0;
+
+    while (off < frame.size())
+    {
+        size_t n = m_shm->Write(frame.data() + off,
+                                frame.size() - off);
+
+        off += n;
+
+        if (n || off == frame.size())
+            continue;
+
+        if (!m_shm->PrepareWaitSpace())
+            continue;
+
+        // ring full, server rings us when it made room
+        if (WaitShm(0) < 0)
+            return -1;
+    }
+
+    return frame.size();
+}
+
+int RPCClient::WaitShm(long deadline)
+{
+    struct pollfd pfd[2];
+
+    pfd[0].fd = m_shm->Doorbell();
+    pfd[0].events = POLLIN;
+    pfd[1].fd = m_socket;
+    pfd[1].events = POLLIN | POLLRDHUP;
+
+    while (1)
+    {
+        int wait = -1;
+
+        if (deadline > 0)
+        {
+            wait = deadline - NowMS();
+
+            if (wait <= 0)
+            {
+                errno = ETIME;
+                return -1;
+            }
+        }
+
+        pfd[0].revents = 0;
+        pfd[1].revents = 0;
+
+        int rc = poll(pfd, 2, wait);
+
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        if (pfd[1].revents)
+        {
+            // server went away
+            errno = ECONNRESET;
+            return -1;
+        }
+
+        if (pfd[0].revents)
+        {
+            m_shm->Drain();
+            return 0;
+        }
+    }
+}
+
+int RPCClient::RecvShm(long timeout)
+{
+    long deadline = (timeout > 0) ? NowMS() + timeout : 0;
+    int spin = 0;
+
+    while (1)
+    {
+        // never read past the end of this response
+        size_t need = 2 - std::min(m_buffer.size(), (size_t) 2);
+
+        if (m_buffer.size() >= 2)
+        {
+            need = ntohs(*(uint16_t*) m_buffer.data()) + 2 - m_buffer.size();
+        }
+
+        if (!need)
+            break;
+
+        if (m_shm->Readable())
+        {
+            size_t used = m_buffer.size();
+
+            m_buffer.resize(used + need);
+            m_buffer.resize(used + m_shm->Read(&m_buffer[used], need));
+
+            spin = 0;
+            continue;
+        }
+
+        if (spin++ < kShmSpin)
+            continue;
+
+        if (!m_shm->PrepareWait())
+            continue;
+
+        int rc = WaitShm(deadline);
+
+        m_shm->FinishWait();
+
+        if (rc < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+bool RPCClient::TakeFrame()
+{
+    if (m_buffer.size() < 2)
+        return false;
+
+    size_t len = ntohs(*(uint16_t*) m_buffer.data()) + 2;
+
+    if (m_buffer.size() < len)
+        return false;
+
+    m_pending.assign(m_buffer.begin() + len, m_buffer.end());
+    m_buffer.resize(len);
+
+    return true;
+}
+
+int RPCClient::TryRecv()
+{
+    if (m_socket < 0 || m_shm)
+    {
+        errno = m_shm ? EOPNOTSUPP : ENOTCONN;
+        return -1;
+    }
+
+    if (m_reading)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    m_buffer.clear();
+    m_buffer.swap(m_pending);
+
+    while (!TakeFrame())
+    {
+        char tmp[4096];
+        ssize_t rc = recv(m_socket, tmp, sizeof(tmp), MSG_DONTWAIT);
+
+        if (rc < 0 && errno == EINTR)
+            continue;
+
+        if (rc <= 0)
+        {
+            int err = rc ? errno : ECONNRESET;
+
+            // a part of a frame waits for the next call
+            m_pending.swap(m_buffer);
+            m_buffer.clear();
+
+            errno = err;
+            return -1;
+        }
+
+        m_buffer.insert(m_buffer.end(), tmp, tmp + rc);
+    }
+
+    return 0;
+}
+
+int RPCClient::Recv(long timeout)
+{
+    if (m_socket < 0)
+        return -1;
+
+    // the reader takes everything
+    if (m_reading)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    m_buffer.clear();
+
+    if (timeout <= 0)
+        timeout = m_timeout;
+
+    if (m_shm)
+        return RecvShm(timeout);
+
+    // frames that came in along with the last one
+    m_buffer.swap(m_pending);
+
+    long deadline = (timeout > 0) ? NowMS() + timeout : 0;
+
+    while (1)
+    {
+        // got everything, the rest is for the next call
+        if (TakeFrame())
+            break;
+
+        int wait = -1;
+
+        if (deadline)
+        {
+            long remain = deadline - NowMS();
+
+            if (remain <= 0)
+            {
+                // timeout, what we have so far waits for the next call
+                m_pending.swap(m_buffer);
+                m_buffer.clear();
+
+                errno = ETIME;
+                return -1;
+            }
+
+            wait = remain;
+        }
+
+        struct pollfd pfd;
+
+        pfd.fd = m_socket;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        int rc = poll(&pfd, 1, wait);
+
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+        else if (!rc)
+        {
+            // timeout, checked on next round
+            continue;
+        }
+
+        char tmp[4096];
+        rc = recv(m_socket, tmp, sizeof(tmp), 0);
+
+        if (rc < 0)
+        {
+            // read error
+            return -1;
+        }
+
+        if (rc == 0)
+        {
+            // connection close
+            errno = ECONNRESET;
+            return -1;
+        }
+
+        m_buffer.insert(m_buffer.end(),
+                        tmp, tmp + rc);
     }
 
     return 0;
@@ -1,11 +1,25 @@
 #ifndef OOLONG_RPC_CLIENT_H
 #define OOLONG_RPC_CLIENT_H
 
+#include <sys/socket.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
 #include "oolong.h"
 #include "json.hpp"
 
 OOLONG_NS_BEGIN
 
+class ShmChannel;
+
 class RPCClient
 {
 public:
@@ -14,17 +28,156 @@ public:
 
     int ConnectTCP(const char *host, int port);
 
-    int Send(const char *method, nlohmann::json &param);
+    // "@name" connects in the abstract namespace
+    int ConnectUnix(const char *path);
+
+    // connect over a unix socket, then move frames through shared
+    // memory rings (server needs EnableShm)
+    int ConnectShm(const char *path);
+
+    // connect to an already resolved address
+    int Connect(const struct sockaddr *addr, socklen_t addrlen);
+
+    bool Connected() const;
+
+    // connected, and the peer has neither closed nor sent unsolicited data
+    bool Healthy() const;
+
+    void Close();
+
+    // socket, for waiting on readiness elsewhere
+    int Fd() const;
+
+    // requests carry this budget (millisec), the server drops those
+    // it couldn't start in time. Recv() without a timeout of its own
+    // waits as long. <= 0 for none (default)
+    void SetTimeout(long timeout);
+
+    // id lets a response be told from others, and from notifications.
+    // Send(), Notify() and Call() fail with EMSGSIZE on a request over
+    // the 65535 bytes a frame holds
+    int Send(const char *method, nlohmann::json &param, uint64_t id = 1);
 
+    // fire and forget, no id and no response. notifications queued
+    // while another thread writes leave with its writev, so back to
+    // back callers share syscalls. 0 once queued (or written)
+    int Notify(const char *method, const nlohmann::json &params);
+
+    // write the queued notifications
+    int Flush();
+
+    // from now on Notify() only queues, a thread writes what queued up
+    // within linger (microsec) of the first one in one writev. Notify()
+    // fails with EAGAIN rather than block while limit bytes are queued.
+    // not over shm
+    int StartFlusher(long linger = 50, size_t limit = 4 << 20);
+
+    // writes what is left first
+    void StopFlusher();
+
+    // Call() from any number of threads. a call waits up to window
+    // (microsec) for others to join it, or until max calls are queued,
+    // then all go out in one write as pipelined frames. a reader
+    // thread hands each response to its caller by id. Recv() fails
+    // with EBUSY meanwhile, notifications pushed by the server are
+    // dropped. not over shm
+    int StartBatching(long window = 20, size_t max = 64);
+
+    // fails calls still waiting. a flusher started by StartFlusher()
+    // before keeps running
+    void StopBatching();
+
+    // the response object, with either "result" or "error". -1 with
+    // errno ETIME after timeout (millisec, <= 0 for SetTimeout())
+    int Call(const char *method,
+             const nlohmann::json &params,
+             nlohmann::json &response,
+             long timeout = 0);
+
+    // next frame, a response or a notification pushed by the server.
+    // timeout <= 0 waits for SetTimeout(), or forever
     int Recv(long timeout /*millisec*/ = 0);
 
+    // Recv() without waiting: -1 with errno EAGAIN until a whole frame
+    // is in, what came so far is kept. not over shm
+    int TryRecv();
+
     int DataLength();
 
     const char* Data();
 
 private:
+    // a whole frame at the front of m_buffer, the rest into m_pending
+    bool TakeFrame();
+
+    int SendShm(const std::string &frame);
+    int RecvShm(long timeout);
+
+    // wait for the server to ring us
+    int WaitShm(long deadline);
+
+    // wait: for a flush in progress, else leave it ours to it
+    int Flush(bool wait);
+
+    // all of frames, m_write_lock held
+    int WriteFrames(std::vector<std::string> &frames);
+
+    void FlushLoop();
+
+    void ReadLoop();
+
+    // fail the calls waiting, errno err
+    void FailCalls(int err);
+
     int m_socket = -1;
+    long m_timeout = 0;
     std::vector<char> m_buffer;
+
+    // read past the last frame, e.g. notifications pushed meanwhile
+    std::vector<char> m_pending;
+    std::unique_ptr<ShmChannel> m_shm;
+
+    // notifications not written yet
+    std::mutex m_queue_lock;
+    std::vector<std::string> m_queue;
+    size_t m_queued = 0;
+
+    // one writer at a time keeps frames whole and in order
+    std::mutex m_write_lock;
+
+    std::thread m_flusher;
+    std::condition_variable m_flush_cond;
+    bool m_flushing = false;
+    long m_linger = 0;
+    size_t m_limit = 0;
+
+    // errno of a failed background write, returned by the next Notify()
+    int m_flush_error = 0;
+
+    // queued frames that cut the linger short, 0 for none
+    size_t m_batch_max = 0;
+
+    // StartBatching() started the flusher, else the linger to restore
+    bool m_batch_flusher = false;
+    long m_batch_linger = 0;
+
+    struct PendingCall
+    {
+        std::condition_variable cond;
+        bool done = false;
+        nlohmann::json response;
+    };
+
+    std::thread m_reader;
+    std::atomic<bool> m_reading { false };
+
+    // by id, of the calls waiting for a response
+    std::mutex m_call_lock;
+    std::unordered_map<uint64_t, PendingCall*> m_calls;
+    uint64_t m_call_seq = 0;
+
+    // the reader stopped on, fails later calls
+    int m_read_error = 0;
 };
 
 OOLONG_NS_END
@@ -0,0 +1,583 @@
+#ifndef OOLONG_RPC_CORO_H
+#define OOLONG_RPC_CORO_H
+
+// coroutine handlers, needs c++20.
+//
+// gcc 12 miscompiles co_await inside a condition and double-frees
+// temporaries of a co_await expression (e.g. a capturing lambda turned
+// into std::function), so keep awaiters and their results in named
+// locals.
+
+#if !defined(__cpp_impl_coroutine)
+#error "rpc_coro.h needs c++20 coroutines"
+#endif
+
+#include <errno.h>
+#include <coroutine>
+#include <exception>
+#include <stdexcept>
+#include <optional>
+#include <functional>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+#include "oolong.h"
+#include "json.hpp"
+#include "rpc_server.h"
+#include "rpc_client.h"
+
+OOLONG_NS_BEGIN
+
+// thrown from a coroutine handler to fail with a specific code
+struct rpc_error : public std::runtime_error
+{
+    rpc_error(int c, const std::string &msg)
+        : std::runtime_error(msg),
+          code(c)
+    {
+    }
+
+    int code;
+};
+
+namespace detail
+{
+
+struct promise_base
+{
+    struct final_awaiter
+    {
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            // hand over to whoever awaits us
+            auto c = h.promise().continuation;
+            return c ? c : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    final_awaiter final_suspend() noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception()
+    {
+        error = std::current_exception();
+    }
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+};
+
+} // namespace detail
+
+// lazy coroutine, starts when awaited
+template <typename T = void>
+class task
+{
+public:
+    struct promise_type : public detail::promise_base
+    {
+        task get_return_object()
+        {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        template <typename U>
+        void return_value(U &&v)
+        {
+            value.emplace(std::forward<U>(v));
+        }
+
+        std::optional<T> value;
+    };
+
+    task(task &&o) noexcept
+        : m_h(o.m_h)
+    {
+        o.m_h = nullptr;
+    }
+
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+
+    ~task()
+    {
+        if (m_h)
+            m_h.destroy();
+    }
+
+    bool await_ready() const noexcept
+    {
+        return (!m_h || m_h.done());
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept
+    {
+        m_h.promise().continuation = c;
+        return m_h;
+    }
+
+    T await_resume()
+    {
+        auto &p = m_h.promise();
+
+        if (p.error)
+            std::rethrow_exception(p.error);
+
+        return std::move(*p.value);
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h)
+        : m_h(h)
+    {
+    }
+
+    std::coroutine_handle<promise_type> m_h;
+};
+
+template <>
+class task<void>
+{
+public:
+    struct promise_type : public detail::promise_base
+    {
+        task get_return_object()
+        {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        void return_void()
+        {
+        }
+    };
+
+    task(task &&o) noexcept
+        : m_h(o.m_h)
+    {
+        o.m_h = nullptr;
+    }
+
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+
+    ~task()
+    {
+        if (m_h)
+            m_h.destroy();
+    }
+
+    bool await_ready() const noexcept
+    {
+        return (!m_h || m_h.done());
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept
+    {
+        m_h.promise().continuation = c;
+        return m_h;
+    }
+
+    void await_resume()
+    {
+        if (m_h.promise().error)
+            std::rethrow_exception(m_h.promise().error);
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h)
+        : m_h(h)
+    {
+    }
+
+    std::coroutine_handle<promise_type> m_h;
+};
+
+namespace detail
+{
+
+// fire and forget, frees itself when finished
+struct detached
+{
+    struct promise_type
+    {
+        detached get_return_object()
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void()
+        {
+        }
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+typedef std::function<task<nlohmann::json>(const nlohmann::json&)> CoCallback;
+
+// owns the params for as long as the handler runs
+inline detached Drive(CoCallback fn,
+                      nlohmann::json params,
+                      JSONRPCServer::Completion c)
+{
+    try
+    {
+        nlohmann::json result = co_await fn(params);
+        c.Done(result);
+    }
+    catch (rpc_error &e)
+    {
+        c.Fail(e.code, e.what());
+    }
+    catch (std::exception &e)
+    {
+        c.Fail(-32603, e.what());
+    }
+}
+
+// a few threads for calls that can only block (file io)
+class BlockingPool
+{
+public:
+    static BlockingPool& Instance()
+    {
+        // never destroyed, threads may still be parked at exit
+        static BlockingPool *s_pool = new BlockingPool(2);
+        return *s_pool;
+    }
+
+    void Run(std::function<void()> fn)
+    {
+        std::unique_lock<std::mutex>
+            lock(m_lock);
+
+        m_jobs.push_back(std::move(fn));
+        m_cond.notify_one();
+    }
+
+private:
+    BlockingPool(int n)
+    {
+        while (n--)
+        {
+            std::thread([this]
+            {
+                for (;;)
+                {
+                    std::function<void()> fn;
+
+                    {
+                        std::unique_lock<std::mutex>
+                            lock(m_lock);
+
+                        m_cond.wait(lock, [this] { return !m_jobs.empty(); });
+
+                        fn = std::move(m_jobs.front());
+                        m_jobs.pop_front();
+                    }
+
+                    fn();
+                }
+            }).detach();
+        }
+    }
+
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    std::deque<std::function<void()>> m_jobs;
+};
+
+} // namespace detail
+
+// register a coroutine handler. it starts on a worker, and is resumed
+// on a worker after each co_await, no worker is held while it waits.
+inline int AddCoMethod(JSONRPCServer &s,
+                       const std::string &name,
+                       const std::string &info,
+                       detail::CoCallback fn,
+                       int flags = 0)
+{
+    if (!fn)
+        return -1;
+
+    return s.AddAsyncMethod(name,
+                            info,
+                            [fn] (const nlohmann::json &params,
+                                  JSONRPCServer::Completion c)
+                            {
+                                detail::Drive(fn, params, std::move(c));
+                            },
+                            flags);
+}
+
+inline int AddCoMethod(JSONRPCServer &s,
+                       const std::string &name,
+                       detail::CoCallback fn,
+                       int flags = 0)
+{
+    return AddCoMethod(s, name, name, std::move(fn), flags);
+}
+
+// co_await sleep_for(ms)
+struct sleep_for
+{
+    explicit sleep_for(long ms)
+        : delay(ms)
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return (delay <= 0);
+    }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        if (JSONRPCServer::Instance().PostAfter(delay, [h] { h.resume(); }) < 0)
+            throw rpc_error(-32603, "server stopped");
+    }
+
+    void await_resume() noexcept
+    {
+    }
+
+    long delay;
+};
+
+// co_await readable(fd, timeout), true if readable before timeout
+struct readable
+{
+    readable(int f, long ms = -1)
+        : fd(f),
+          timeout(ms),
+          ready(false)
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        int rc = JSONRPCServer::Instance().PostOnReadable(
+            fd,
+            timeout,
+            [this, h] (bool r)
+            {
+                ready = r;
+                h.resume();
+            });
+
+        // never resumed otherwise
+        if (rc < 0)
+            throw rpc_error(-32603, "server stopped");
+    }
+
+    bool await_resume() const noexcept
+    {
+        return ready;
+    }
+
+    int fd;
+    long timeout;
+    bool ready;
+};
+
+// co_await offload(fn), runs a blocking call off the workers
+template <typename T>
+struct offload
+{
+    explicit offload(std::function<T()> f)
+        : fn(std::move(f))
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        detail::BlockingPool::Instance().Run([this, h]
+        {
+            try
+            {
+                value.emplace(fn());
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+
+            JSONRPCServer::Instance().Post([h] { h.resume(); });
+        });
+    }
+
+    T await_resume()
+    {
+        if (error)
+            std::rethrow_exception(error);
+
+        return std::move(*value);
+    }
+
+    std::function<T()> fn;
+    std::optional<T> value;
+    std::exception_ptr error;
+};
+
+// call another server, the worker is released while waiting.
+// c must be connected over a socket (not shm), and is closed when the
+// call fails: a late response would be taken for the next call's
+inline task<nlohmann::json> call(RPCClient &c,
+                                 std::string method,
+                                 nlohmann::json params,
+                                 long timeout = -1)
+{
+    static std::atomic<uint64_t> s_seq(0);
+
+    uint64_t id = ++s_seq;
+
+    if (c.Send(method.c_str(), params, id) < 0)
+    {
+        c.Close();
+        throw rpc_error(-32603, "send failed");
+    }
+
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(timeout);
+
+    while (1)
+    {
+        // frames read along with an earlier one come first
+        if (c.TryRecv() == 0)
+        {
+            auto resp = nlohmann::json::parse(c.Data(),
+                                              c.Data() + c.DataLength(),
+                                              nullptr,
+                                              false);
+
+            // skip notifications pushed by the server
+            if (resp.is_object() &&
+                resp.value("id", nlohmann::json()) == id)
+            {
+                co_return resp;
+            }
+
+            continue;
+        }
+
+        if (errno != EAGAIN)
+        {
+            c.Close();
+            throw rpc_error(-32603, "recv failed");
+        }
+
+        long wait = -1;
+
+        if (timeout >= 0)
+        {
+            wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       deadline - std::chrono::steady_clock::now()).count();
+
+            if (wait <= 0)
+            {
+                c.Close();
+                throw rpc_error(-32603, "call timeout");
+            }
+        }
+
+        // keep co_await out of the condition, gcc 12 miscompiles that
+        readable r(c.Fd(), wait);
+        bool ready = co_await r;
+
+        if (!ready)
+        {
+            c.Close();
+            throw rpc_error(-32603, "call timeout");
+        }
+    }
+}
+
+inline task<std::string> read_file(std::string path)
+{
+    // named awaiter, gcc 12 double-frees temporaries of a co_await
+    // expression
+    offload<std::string> op([path]
+    {
+        std::ifstream f(path, std::ios::binary);
+
+        if (!f)
+            throw rpc_error(-32603, "open failed: " + path);
+
+        std::ostringstream ss;
+        ss << f.rdbuf();
+
+        return ss.str();
+    });
+
+    std::string data = co_await op;
+
+    co_return data;
+}
+
+inline task<size_t> write_file(std::string path, std::string data)
+{
+    offload<size_t> op([path, data]
+    {
+        std::ofstream f(path, std::ios::binary | std::ios::trunc);
+
+        if (!f.write(data.data(), data.size()))
+            throw rpc_error(-32603, "write failed: " + path);
+
+        return data.size();
+    });
+
+    size_t n = co_await op;
+
+    co_return n;
+}
+
+OOLONG_NS_END
+
+#endif
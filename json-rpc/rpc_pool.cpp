@@ -0,0 +1,552 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <string.h>
+#include <time.h>
+
+#include "rpc_pool.h"
+
+#define DLOG(fmt, ...) \
+    fprintf(stderr, fmt "\n", ##__VA_ARGS__);
+
+OOLONG_NS_BEGIN
+
+static long NowMS()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ts.tv_sec * 1000) +
+           (ts.tv_nsec / 1000000);
+}
+
+struct RPCClientPool::Endpoint
+{
+    std::string host;
+    int port;
+
+    // cached address
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    long resolved_at;
+
+    // warm connections
+    std::vector<std::unique_ptr<RPCClient>> idle;
+
+    // leased connections
+    size_t outstanding;
+
+    // reconnect backoff
+    long backoff;
+    long retry_at;
+};
+
+RPCClientPool::Conn::Conn()
+    : m_pool(NULL),
+      m_ep(NULL),
+      m_pending(false)
+{
+}
+
+RPCClientPool::Conn::Conn(RPCClientPool *pool,
+                          Endpoint *ep,
+                          std::unique_ptr<RPCClient> c)
+    : m_pool(pool),
+      m_ep(ep),
+      m_client(std::move(c)),
+      m_pending(false)
+{
+}
+
+RPCClientPool::Conn::Conn(Conn &&o)
+    : m_pool(o.m_pool),
+      m_ep(o.m_ep),
+      m_client(std::move(o.m_client)),
+      m_pending(o.m_pending)
+{
+    o.m_pool = NULL;
+    o.m_ep = NULL;
+    o.m_pending = false;
+}
+
+RPCClientPool::Conn&
+RPCClientPool::Conn::operator=(Conn &&o)
+{
+    if (this == &o)
+        return *this;
+
+    Release();
+
+    m_pool = o.m_pool;
+    m_ep = o.m_ep;
+    m_client = std::move(o.m_client);
+    m_pending = o.m_pending;
+
+    o.m_pool = NULL;
+    o.m_ep = NULL;
+    o.m_pending = false;
+
+    return *this;
+}
+
+RPCClientPool::Conn::~Conn()
+{
+    Release();
+}
+
+bool RPCClientPool::Conn::Valid() const
+{
+    return (m_pool && m_ep && m_client);
+}
+
+int RPCClientPool::Conn::Send(const char *method, nlohmann::json &param)
+{
+    if (!Valid())
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    // a warm connection may have been closed by the peer meanwhile
+    if (!m_client->Healthy())
+    {
+        m_client = m_pool->Open(m_ep);
+
+        if (!m_client)
+            return -1;
+    }
+
+    int rc = m_client->Send(method, param);
+
+    if (rc < 0)
+    {
+        // nothing was delivered, safe to retry once
+        m_client = m_pool->Open(m_ep);
+
+        if (!m_client)
+            return -1;
+
+        rc = m_client->Send(method, param);
+    }
+
+    m_pending = (rc >= 0);
+    return rc;
+}
+
+int RPCClientPool::Conn::Recv(long timeout)
+{
+    if (!Valid())
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    int rc = m_client->Recv(timeout);
+
+    m_pending = false;
+
+    if (rc < 0)
+    {
+        int err = errno;
+
+        // a late response would confuse the next caller
+        m_client->Close();
+
+        if (err != ETIME)
+        {
+            std::unique_lock<std::mutex>
+                lock(m_pool->m_lock);
+
+            m_pool->OnFailure(m_ep, NowMS());
+        }
+
+        errno = err;
+    }
+
+    return rc;
+}
+
+int RPCClientPool::Conn::DataLength()
+{
+    if (!m_client)
+        return 0;
+
+    return m_client->DataLength();
+}
+
+const char* RPCClientPool::Conn::Data()
+{
+    if (!m_client)
+        return NULL;
+
+    return m_client->Data();
+}
+
+void RPCClientPool::Conn::Release()
+{
+    if (!m_pool || !m_ep)
+        return;
+
+    bool reuse = (m_client &&
+                  m_client->Connected() &&
+                  !m_pending);
+
+    m_pool->Put(m_ep, std::move(m_client), reuse);
+
+    m_pool = NULL;
+    m_ep = NULL;
+    m_pending = false;
+}
+
+RPCClientPool::RPCClientPool()
+    : RPCClientPool(Options())
+{
+}
+
+RPCClientPool::RPCClientPool(const Options &opt)
+    : m_opt(opt),
+      m_rand(std::random_device()())
+{
+}
+
+RPCClientPool::~RPCClientPool()
+{
+}
+
+size_t RPCClientPool::EndpointCount() const
+{
+    std::unique_lock<std::mutex>
+        lock(m_lock);
+
+    return m_endpoints.size();
+}
+
+int RPCClientPool::AddEndpoint(const char *host, int port)
+{
+    if (!host)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    std::unique_ptr<Endpoint> ep(new (std::nothrow) Endpoint());
+
+    if (!ep)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ep->host = host;
+    ep->port = port;
+    ep->addrlen = 0;
+    ep->resolved_at = 0;
+    ep->outstanding = 0;
+    ep->backoff = 0;
+    ep->retry_at = 0;
+
+    std::unique_lock<std::mutex>
+        lock(m_lock);
+
+    m_endpoints.emplace_back(std::move(ep));
+    return 0;
+}
+
+RPCClientPool::Endpoint* RPCClientPool::Pick()
+{
+    // called with m_lock held
+    if (m_endpoints.empty())
+        return NULL;
+
+    long now = NowMS();
+
+    std::vector<Endpoint*> ready;
+
+    for (auto &ep : m_endpoints)
+    {
+        if (ep->retry_at <= now)
+            ready.push_back(ep.get());
+    }
+
+    if (ready.empty())
+    {
+        // everything is backing off, probe the earliest one
+        Endpoint *first = m_endpoints[0].get();
+
+        for (auto &ep : m_endpoints)
+        {
+            if (ep->retry_at < first->retry_at)
+                first = ep.get();
+        }
+
+        return first;
+    }
+
+    if (ready.size() == 1)
+        return ready[0];
+
+    if (m_opt.balance == POWER_OF_TWO)
+    {
+        size_t a = m_rand() % ready.size();
+        size_t b = m_rand() % (ready.size() - 1);
+
+        if (b >= a)
+            ++b;
+
+        return (ready[b]->outstanding < ready[a]->outstanding) ?
+                ready[b] : ready[a];
+    }
+
+    // least outstanding, random start to break ties
+    size_t start = m_rand() % ready.size();
+    Endpoint *best = ready[start];
+
+    for (size_t i = 1; i < ready.size(); ++i)
+    {
+        Endpoint *ep = ready[(start + i) % ready.size()];
+
+        if (ep->outstanding < best->outstanding)
+            best = ep;
+    }
+
+    return best;
+}
+
+int RPCClientPool::Resolve(Endpoint *ep,
+                           struct sockaddr_storage *addr,
+                           socklen_t *addrlen)
+{
+    std::string host;
+    int port;
+
+    {
+        std::unique_lock<std::mutex>
+            lock(m_lock);
+
+        if (ep->addrlen &&
+            (NowMS() - ep->resolved_at) < m_opt.resolve_ttl)
+        {
+            memcpy(addr, &ep->addr, ep->addrlen);
+            *addrlen = ep->addrlen;
+            return 0;
+        }
+
+        host = ep->host;
+        port = ep->port;
+    }
+
+    struct addrinfo hints, *res;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    // unlocked, other endpoints go on meanwhile
+    if (getaddrinfo(host.c_str(),
+                    std::to_string(port).c_str(),
+                    &hints,
+                    &res) != 0)
+    {
+        DLOG("getaddrinfo failed: %s", host.c_str());
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *addrlen = res->ai_addrlen;
+
+    freeaddrinfo(res);
+
+    std::unique_lock<std::mutex>
+        lock(m_lock);
+
+    memcpy(&ep->addr, addr, *addrlen);
+    ep->addrlen = *addrlen;
+    ep->resolved_at = NowMS();
+
+    return 0;
+}
+
+std::unique_ptr<RPCClient> RPCClientPool::Open(Endpoint *ep)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    if (Resolve(ep, &addr, &addrlen) < 0)
+    {
+        std::unique_lock<std::mutex>
+            lock(m_lock);
+
+        OnFailure(ep, NowMS());
+        return NULL;
+    }
+
+    std::unique_ptr<RPCClient> c(
+        new (std::nothrow) RPCClient());
+
+    if (!c)
+        return NULL;
+
+    if (c->Connect((struct sockaddr*) &addr, addrlen) < 0)
+    {
+        std::unique_lock<std::mutex>
+            lock(m_lock);
+
+        OnFailure(ep, NowMS());
+        return NULL;
+    }
+
+    std::unique_lock<std::mutex>
+        lock(m_lock);
+
+    OnSuccess(ep);
+    return c;
+}
+
+void RPCClientPool::OnFailure(Endpoint *ep, long now)
+{
+    // called with m_lock held
+    ep->backoff = (ep->backoff) ?
+        std::min(ep->backoff * 2, m_opt.backoff_max) :
+        m_opt.backoff_min;
+
+    ep->retry_at = now + ep->backoff;
+
+    // the address may have moved
+    ep->addrlen = 0;
+
+    for (auto &c : ep->idle)
+        c->Close();
+
+    ep->idle.clear();
+}
+
+void RPCClientPool::OnSuccess(Endpoint *ep)
+{
+    // called with m_lock held
+    ep->backoff = 0;
+    ep->retry_at = 0;
+}
+
+RPCClientPool::Conn RPCClientPool::Get()
+{
+    size_t tries;
+
+    {
+        std::unique_lock<std::mutex>
+            lock(m_lock);
+
+        tries = m_endpoints.size();
+    }
+
+    while (tries--)
+    {
+        Endpoint *ep = NULL;
+        std::unique_ptr<RPCClient> c;
+
+        {
+            std::unique_lock<std::mutex>
+                lock(m_lock);
+
+            ep = Pick();
+
+            if (!ep)
+                break;
+
+            ++ep->outstanding;
+
+            while (!ep->idle.empty())
+            {
+                c = std::move(ep->idle.back());
+                ep->idle.pop_back();
+
+                if (c->Healthy())
+                    break;
+
+                c.reset();
+            }
+        }
+
+        if (!c)
+        {
+            c = Open(ep);
+        }
+
+        if (c)
+        {
+            return Conn(this, ep, std::move(c));
+        }
+
+        std::unique_lock<std::mutex>
+            lock(m_lock);
+
+        --ep->outstanding;
+    }
+
+    errno = ECONNREFUSED;
+    return Conn();
+}
+
+void RPCClientPool::Put(Endpoint *ep,
+                        std::unique_ptr<RPCClient> c,
+                        bool reuse)
+{
+    std::unique_lock<std::mutex>
+        lock(m_lock);
+
+    if (ep->outstanding)
+        --ep->outstanding;
+
+    if (!c || !reuse)
+        return;
+
+    if (ep->idle.size() >= m_opt.max_idle)
+        return;
+
+    ep->idle.emplace_back(std::move(c));
+}
+
+int RPCClientPool::Prepare(size_t n)
+{
+    std::vector<Endpoint*> eps;
+
+    {
+        std::unique_lock<std::mutex>
+            lock(m_lock);
+
+        for (auto &ep : m_endpoints)
+            eps.push_back(ep.get());
+    }
+
+    int opened = 0;
+
+    for (auto *ep : eps)
+    {
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex>
+                    lock(m_lock);
+
+                if (ep->idle.size() >= std::min(n, m_opt.max_idle))
+                    break;
+            }
+
+            auto c = Open(ep);
+
+            if (!c)
+                break;
+
+            std::unique_lock<std::mutex>
+                lock(m_lock);
+
+            ep->idle.emplace_back(std::move(c));
+            ++opened;
+        }
+    }
+
+    return opened;
+}
+
+OOLONG_NS_END
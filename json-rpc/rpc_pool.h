@@ -0,0 +1,121 @@
+#ifndef OOLONG_RPC_POOL_H
+#define OOLONG_RPC_POOL_H
+
+#include <sys/socket.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <random>
+
+#include "oolong.h"
+#include "json.hpp"
+#include "rpc_client.h"
+
+OOLONG_NS_BEGIN
+
+class RPCClientPool
+{
+public:
+    enum Balance
+    {
+        LEAST_OUTSTANDING,
+        POWER_OF_TWO,
+    };
+
+    struct Options
+    {
+        Balance balance = POWER_OF_TWO;
+
+        // idle connections kept warm per endpoint
+        size_t max_idle = 8;
+
+        // reconnect backoff (millisec)
+        long backoff_min = 10;
+        long backoff_max = 5000;
+
+        // resolved address cache lifetime (millisec)
+        long resolve_ttl = 30000;
+    };
+
+    struct Endpoint;
+
+    // a pooled connection, leased to a single caller at a time
+    class Conn
+    {
+    public:
+        Conn();
+        Conn(Conn &&o);
+        Conn& operator=(Conn &&o);
+        ~Conn();
+
+        bool Valid() const;
+
+        int Send(const char *method, nlohmann::json &param);
+
+        int Recv(long timeout /*millisec*/ = 0);
+
+        int DataLength();
+
+        const char* Data();
+
+        // give the connection back to the pool (also done on destruction)
+        void Release();
+
+        friend RPCClientPool;
+
+    private:
+        Conn(RPCClientPool *pool,
+             Endpoint *ep,
+             std::unique_ptr<RPCClient> c);
+
+        RPCClientPool *m_pool;
+        Endpoint *m_ep;
+        std::unique_ptr<RPCClient> m_client;
+
+        // a request is sent but its response not yet received
+        bool m_pending;
+    };
+
+    RPCClientPool();
+    RPCClientPool(const Options &opt);
+    virtual ~RPCClientPool();
+
+    int AddEndpoint(const char *host, int port);
+
+    // lease a connection to the best endpoint
+    Conn Get();
+
+    // warm up to n connections per endpoint
+    int Prepare(size_t n);
+
+    size_t EndpointCount() const;
+
+private:
+    Endpoint* Pick();
+
+    // ep's address into addr, looked up again once older than
+    // resolve_ttl. m_lock must not be held, a lookup may take long
+    int Resolve(Endpoint *ep,
+                struct sockaddr_storage *addr,
+                socklen_t *addrlen);
+
+    std::unique_ptr<RPCClient> Open(Endpoint *ep);
+
+    void Put(Endpoint *ep, std::unique_ptr<RPCClient> c, bool reuse);
+
+    void OnFailure(Endpoint *ep, long now);
+
+    void OnSuccess(Endpoint *ep);
+
+    Options m_opt;
+
+    mutable std::mutex m_lock;
+    std::vector<std::unique_ptr<Endpoint>> m_endpoints;
+    std::minstd_rand m_rand;
+};
+
+OOLONG_NS_END
+
+#endif
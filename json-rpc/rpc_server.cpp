@@ -2,18 +2,104 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <signal.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <math.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+#include "buffer/chain.h"
+
+#include "unix_addr.h"
+#include "shm_channel.h"
 
 #include "rpc_server.h"
 
+#ifndef NDEBUG
 #define DLOG(fmt, ...) \
 { \
     fprintf(stderr, "%ld [%s] %s(%d): " fmt "\n", \
             time(NULL), __func__, __FILE__, __LINE__, ##__VA_ARGS__); \
 }
+#else
+#define DLOG(fmt, ...)
+#endif
 
 OOLONG_NS_BEGIN
 
-class Client
+static uint64_t NowMS()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// deadline of the request the thread is serving
+static thread_local uint64_t t_deadline = 0;
+
+// and its cancel flag
+static thread_local std::atomic<bool> *t_cancelled = NULL;
+
+// and its trace id
+static thread_local uint64_t t_trace = 0;
+
+static volatile sig_atomic_t s_trace_signal = 0;
+
+static void OnTraceSignal(int)
+{
+    s_trace_signal = 1;
+}
+
+// probe period of the loop (millisec)
+static const long TICK_MS = 100;
+
+// asks a stuck loop thread for its stack, rarely used otherwise and
+// ignored by default
+static const int STALL_SIGNAL = SIGURG;
+
+// what the 2 byte length of a frame can tell
+static const size_t MAX_PAYLOAD = 0xFFFF;
+
+// ids are echoed in every reply, and an error reply must always fit
+static const size_t MAX_ID_SIZE = 1024;
+
+// longest request timeout taken as given, a day
+static const double MAX_TIMEOUT_MS = 24 * 3600 * 1000.0;
+
+static void OnStallSignal(int)
+{
+    static const char msg[] = "event loop stack:\n";
+
+    void *frames[64];
+    int n = backtrace(frames, 64);
+
+    if (write(STDERR_FILENO, msg, sizeof(msg) - 1) < 0)
+    {
+        ;
+    }
+
+    backtrace_symbols_fd(frames, n, STDERR_FILENO);
+}
+
+static long TimeLeft(uint64_t deadline)
+{
+    if (!deadline)
+        return -1;
+
+    uint64_t now = NowMS();
+
+    return (deadline > now) ? (long) (deadline - now) : 0;
+}
+
+class Client : public Reactor::Handler
 {
 public:
     Client(int sock, JSONRPCServer &s);
@@ -22,12 +108,34 @@ public:
     void Close();
     void CloseOnEmpty();
 
-    int Read();
+    int ReadShm();
     int Write(const char *data, unsigned int datalen);
-    int Flush();
+    int Write(std::string &&data);
+
+    // queue a frame shared with other clients
+    int Write(BufferChain::Segment frame);
+
+    int FlushShm();
+
+    // output drained below the low watermark, take requests again
+    void Resume();
 
-    static void OnRead(int, short, void*);
-    static void OnWrite(int, short, void*);
+    // the reply just written belongs to a traced request
+    void Traced(uint64_t trace, uint64_t since);
+
+    // move frames through shared memory from now on
+    int AttachShm(std::unique_ptr<ShmChannel> shm);
+
+    // reactor callbacks
+    char* RecvBuffer(size_t *len) override;
+    void OnRecv(const char *data, ssize_t n) override;
+    int PendingOutput(struct iovec *iov, int max) override;
+    std::shared_ptr<void> HoldOutput(int cnt) override;
+    void OnSent(size_t n) override;
+    void OnError(int err) override;
+
+    // shm doorbell rang
+    void OnReadable() override;
 
     friend JSONRPCServer;
 
@@ -36,12 +144,46 @@ private:
     long m_timestamp;
 
     int m_socket;
-    struct event *m_ev[2];
-    Buffer m_buffer[2];
 
-    bool m_got_all;
+    Buffer m_input;
+    BufferChain m_output;
+
     bool m_close_on_empty;
 
+    // output above the high watermark, not reading
+    bool m_paused;
+
+    // shared memory transport, socket only tells liveness
+    std::unique_ptr<ShmChannel> m_shm;
+
+    // when the last read came in, if tracing (microsec)
+    uint64_t m_recv_us;
+
+    // bytes ever queued and sent, place traced replies in the output
+    uint64_t m_out_queued;
+    uint64_t m_out_sent;
+
+    struct TracedReply
+    {
+        uint64_t end;
+        uint64_t trace;
+        uint64_t since;
+    };
+
+    std::deque<TracedReply> m_traced;
+
+    // subscribed to
+    std::set<std::string> m_topics;
+
+    // output went out, m_traced may be done
+    void Sent(size_t n);
+
+    // handle every complete frame in m_input
+    void Parse();
+
+    // output was queued
+    int Queued();
+
     void (*m_on_close_cb)(Client*, void *);
     void *m_on_close_param;
 
@@ -52,9 +194,11 @@ Client::Client(int sock, JSONRPCServer &srv)
     : m_id(srv.GenUID()),
       m_timestamp(time(NULL)),
       m_socket(sock),
-      m_ev { NULL, NULL },
-      m_got_all(false),
       m_close_on_empty(false),
+      m_paused(false),
+      m_recv_us(0),
+      m_out_queued(0),
+      m_out_sent(0),
       m_on_close_cb(NULL),
       m_on_close_param(NULL),
       m_server(srv)
@@ -72,27 +216,25 @@ void Client::Close()
 {
     DLOG();
 
-    if (m_ev[0])
-    {
-        event_free(m_ev[0]);
-        m_ev[0] = NULL;
-    }
+    if (m_socket < 0)
+        return;
 
-    if (m_ev[1])
+    auto &r = *m_server.m_reactor;
+
+    if (m_shm)
     {
-        event_free(m_ev[1]);
-        m_ev[1] = NULL;
+        r.Remove(m_shm->Doorbell());
+        m_shm.reset();
     }
 
-    if (m_socket >= 0)
-    {
-        close(m_socket);
-        m_socket = -1;
+    r.Remove(m_socket);
 
-        if (m_on_close_cb)
-        {
-            m_on_close_cb(this, m_on_close_param);
-        }
+    close(m_socket);
+    m_socket = -1;
+
+    if (m_on_close_cb)
+    {
+        m_on_close_cb(this, m_on_close_param);
     }
 }
 
@@ -100,649 +242,2749 @@ void Client::CloseOnEmpty()
 {
     DLOG();
     m_close_on_empty = true;
-    event_add(m_ev[1], NULL);
+
+    auto &r = *m_server.m_reactor;
+
+    // stop taking requests, flush what's left
+    r.EnableRead(m_socket, false);
+
+    if (m_shm)
+    {
+        FlushShm();
+    }
+
+    if (!m_output.Empty())
+    {
+        // closed from OnSent, or the doorbell on shm
+        if (!m_shm)
+            r.WantWrite(m_socket);
+
+        return;
+    }
+
+    // we're inside Parse(), close once it unwound
+    JSONRPCServer *srv = &m_server;
+    int id = m_id;
+
+    r.Post([srv, id]
+    {
+        auto *c = srv->GetClient(id);
+
+        if (c)
+            c->Close();
+    });
+}
+
+char* Client::RecvBuffer(size_t *len)
+{
+    auto &b = m_input;
+
+    if (m_shm)
+        return NULL;
+
+    *len = b.Unused();
+    return b.Tail();
 }
 
-int Client::Read()
+void Client::OnRecv(const char *data, ssize_t n)
 {
     DLOG();
-    auto &b = m_buffer[0];
 
-    int rc = read(m_socket,
-                  b.Tail(),
-                  b.Unused());
+    if (n <= 0)
+    {
+        // peer closed, or failed
+        Close();
+        return;
+    }
+
+    if (m_shm)
+    {
+        // nothing but the handshake goes over the socket
+        DLOG("unexpected data on shm client");
+        Close();
+        return;
+    }
+
+    auto &b = m_input;
 
-    if (rc <= 0)
+    if (data != b.Tail())
     {
-        return rc;
+        // landed in a buffer of the reactor
+        if (b.Unused() < (size_t) n)
+            b.Resize(b.Used() + n);
+
+        memcpy(b.Tail(), data, n);
     }
 
-    b.Commit(rc);
+    b.Commit(n);
+
+    if (m_server.m_tracer.Enabled())
+        m_recv_us = Tracer::Now();
+
+    Parse();
+}
+
+int Client::ReadShm()
+{
+    DLOG();
+    auto &b = m_input;
 
-    if (b.Used() > 0x10001)
+    if (m_shm->Corrupted())
     {
-        errno = EOVERFLOW;
+        errno = EPROTO;
         return -1;
     }
 
-    if (!m_got_all)
+    int total = 0;
+
+    while (!m_close_on_empty &&
+           !m_paused &&
+           m_shm->Readable())
     {
-        if (b.Used() < 2)
-        {
-            // no header
-            return rc;
-        }
+        size_t n = m_shm->Read(b.Tail(), b.Unused());
 
-        uint16_t datalen = ntohs(*(uint16_t*) b.Data());
+        if (!n)
+            break;
 
-        if (b.Used() < (datalen + 2))
-        {
-            // no enuf data
-            return rc;
-        }
+        b.Commit(n);
+        total += n;
+
+        if (m_server.m_tracer.Enabled())
+            m_recv_us = Tracer::Now();
+
+        Parse();
+    }
+
+    return total;
+}
+
+void Client::Parse()
+{
+    auto &b = m_input;
+    size_t pos = 0;
+
+    // connection is persistent, handle every complete frame
+    while (!m_close_on_empty &&
+           !m_paused &&
+           b.Used() - pos >= 2)
+    {
+        uint16_t datalen = ntohs(*(uint16_t*) b.Data(pos));
 
-        m_got_all = true;
+        // no enuf data
+        if (b.Used() - pos < (size_t) (datalen + 2))
+            break;
 
         if (m_server.Push(m_id,
-                          b.Head() + 2,
-                          datalen) < 0)
+                          b.Data(pos) + 2,
+                          datalen,
+                          m_recv_us) < 0)
         {
             CloseOnEmpty();
         }
+
+        pos += datalen + 2;
     }
 
-    return rc;
+    // one move for all the frames handled
+    b.Remove(pos);
+
+    if (b.Used() >= 2)
+    {
+        uint16_t datalen = ntohs(*(uint16_t*) b.Data());
+
+        // room for the rest of the frame
+        if (b.Size() < (size_t) (datalen + 2))
+            b.Resize(datalen + 2);
+    }
 }
 
 int Client::Write(const char *data, unsigned int datalen)
 {
     DLOG();
-    auto &b = m_buffer[1];
 
     if (datalen == 0)
         return datalen;
 
-    if (b.Unused() < datalen)
-    {
-        errno = ENOBUFS;
-        return -1;
-    }
+    m_output.Append(data, datalen);
+    m_out_queued += datalen;
 
-    memcpy(b.Tail(), data, datalen);
-    b.Commit(datalen);
+    if (Queued() < 0)
+        return -1;
 
-    event_add(m_ev[1], NULL);
     return datalen;
 }
 
-int Client::Flush()
+int Client::Write(std::string &&data)
 {
     DLOG();
-    auto &b = m_buffer[1];
+    int datalen = data.size();
 
-    if (b.Empty())
-    {
-        event_del(m_ev[1]);
-        return 0;
-    }
+    if (datalen == 0)
+        return datalen;
 
-    int rc = write(m_socket,
-                   b.Head(),
-                   b.Used());
+    m_output.Append(std::move(data));
+    m_out_queued += datalen;
 
-    if (rc <= 0)
-    {
+    if (Queued() < 0)
         return -1;
-    }
-
-    b.Remove(rc);
-
-    if (b.Empty())
-    {
-        event_del(m_ev[1]);
-    }
 
-    return rc;
+    return datalen;
 }
 
-
-void Client::OnRead(int, short, void *userdata)
+int Client::Write(BufferChain::Segment frame)
 {
     DLOG();
-    auto *c = static_cast<Client*> (userdata);
+    int datalen = frame->size();
 
-    if (!c)
-        return;
+    m_output.Append(std::move(frame));
+    m_out_queued += datalen;
 
-    if (c->Read() <= 0)
-    {
-        if (errno == EWOULDBLOCK ||
-            errno == EAGAIN)
-        {
-            return;
-        }
+    if (Queued() < 0)
+        return -1;
 
-        c->Close();
-    }
+    return datalen;
 }
 
-void Client::OnWrite(int, short, void *userdata)
+int Client::Queued()
 {
-    DLOG();
-    auto *c = static_cast<Client*> (userdata);
+    // the peer isn't keeping up, stop taking requests until it is
+    if (!m_paused &&
+        m_output.Size() >= m_server.m_output_high)
+    {
+        m_paused = true;
+        ++m_server.m_metrics.output_paused;
 
-    if (!c)
-        return;
+        // the socket still tells when a shm peer is gone
+        if (!m_shm && !m_close_on_empty)
+            m_server.m_reactor->EnableRead(m_socket, false);
+    }
 
-    if (c->Flush() < 0)
+    if (m_shm)
     {
-        if (errno == EWOULDBLOCK ||
-            errno == EAGAIN)
+        // copying into the ring never blocks
+        if (FlushShm() < 0 &&
+            errno != EAGAIN)
         {
-            return;
+            return -1;
         }
 
-        DLOG("flush failed: %s", strerror(errno));
-        c->Close();
-        return;
+        return 0;
     }
 
-    // close on empty
-    if (c->m_close_on_empty &&
-        c->m_buffer[1].Empty())
-    {
-        c->Close();
-        // if (c->m_on_close_cb)
-        // {
-        //     c->m_on_close_cb(c, c->m_on_close_param);
-        //     return;
-        // }
-        // delete c;
-    }
+    return m_server.m_reactor->WantWrite(m_socket);
 }
 
-JSONRPCServer::JSONRPCServer()
-    : m_socket(-1),
-      m_ev_base(NULL),
-      m_ev { NULL, NULL },
-      m_stop(false),
-      m_counter(0)
+void Client::Resume()
 {
-    ;
+    if (!m_paused ||
+        m_output.Size() > m_server.m_output_low)
+    {
+        return;
+    }
+
+    m_paused = false;
+
+    if (m_close_on_empty)
+        return;
+
+    if (!m_shm)
+        m_server.m_reactor->EnableRead(m_socket, true);
+
+    // requests that came in before we stopped
+    Parse();
 }
 
-JSONRPCServer::~JSONRPCServer()
+void Client::Traced(uint64_t trace, uint64_t since)
 {
+    m_traced.push_back(TracedReply { m_out_queued, trace, since });
+
+    // shm may have taken it already
+    Sent(0);
 }
 
-int JSONRPCServer::GenUID()
+void Client::Sent(size_t n)
 {
-    int id;
+    m_out_sent += n;
 
-    while (1)
+    while (!m_traced.empty() &&
+           m_traced.front().end <= m_out_sent)
     {
-        id = ++m_counter;
-
-        if (!id)
-            continue;
-
-        if (HasClient(id))
-            continue;
+        auto &r = m_traced.front();
 
-        break;
+        m_server.m_tracer.Record(r.trace, "reply", r.since, Tracer::Now());
+        m_traced.pop_front();
     }
-
-    return id;
 }
 
-bool JSONRPCServer::Ready() const
+int Client::PendingOutput(struct iovec *iov, int max)
 {
-    return (m_socket >= 0);
+    if (m_shm || max < 1)
+        return 0;
+
+    return m_output.Fill(iov, max);
 }
 
-int JSONRPCServer::BindTCP(int port)
+std::shared_ptr<void> Client::HoldOutput(int cnt)
 {
-    struct addrinfo hints, *res;
+    return m_output.Hold(cnt);
+}
 
-    memset(&hints, 0, sizeof(hints));
+void Client::OnSent(size_t n)
+{
+    DLOG();
 
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
+    m_output.Remove(n);
+    Sent(n);
 
-    if (getaddrinfo(NULL,
-                    std::to_string(port).c_str(),
-                    &hints,
-                    &res) != 0)
+    // close on empty
+    if (m_close_on_empty &&
+        m_output.Empty())
     {
-        return -1;
+        Close();
+        return;
     }
 
-    do
-    {
-        m_socket = socket(res->ai_family,
-                          res->ai_socktype,
-                          res->ai_protocol);
+    Resume();
+}
 
-        if (m_socket < 0)
-            break;
+void Client::OnError(int err)
+{
+    DLOG("send failed: %s", strerror(err));
+    Close();
+}
 
-        int opt = 1;
+int Client::FlushShm()
+{
+    DLOG();
+    auto &b = m_output;
 
-        if (setsockopt(m_socket,
-                       SOL_SOCKET,
-                       SO_REUSEADDR,
-                       &opt, sizeof(opt)) == -1)
+    int total = 0;
+
+    while (!b.Empty())
+    {
+        size_t n = m_shm->Write(b.Head(), b.HeadSize());
+
+        if (n)
         {
-            break;
+            b.Remove(n);
+            total += n;
+            continue;
         }
 
-        // non-blocking
-        evutil_make_socket_nonblocking(m_socket);
-
-        if (bind(m_socket,
-                 res->ai_addr,
-                 res->ai_addrlen) < 0)
+        if (m_shm->PrepareWaitSpace())
         {
+            // ring full, client rings us once it made room
             break;
         }
+    }
 
-        freeaddrinfo(res);
-        return 0;
-
-    } while (0);
+    if (total)
+        Sent(total);
 
-    if (m_socket >= 0)
+    if (!total && !b.Empty())
     {
-        close(m_socket);
-        m_socket = -1;
+        errno = EAGAIN;
+        return -1;
     }
 
-    freeaddrinfo(res);
-    return -1;
+    return total;
 }
 
-void JSONRPCServer::Stop()
+void Client::OnReadable()
 {
-    if (m_stop)
+    DLOG();
+
+    if (!m_shm)
         return;
 
-    {
-        std::unique_lock<std::mutex>
-            lock(m_task_lock);
+    m_shm->Drain();
 
-        m_stop = true;
-        m_task_cond.notify_all();
+    // the client may have made room for pending output
+    if (FlushShm() < 0 &&
+        errno != EAGAIN)
+    {
+        Close();
+        return;
     }
 
-    for (auto  &w : m_workers)
+    if (m_close_on_empty &&
+        m_output.Empty())
     {
-        if (!w.joinable())
-            continue;
-        w.join();
+        Close();
+        return;
     }
 
-    if (m_ev_base)
+    Resume();
+
+    if (ReadShm() < 0)
     {
-        event_base_loopbreak(m_ev_base);
+        DLOG("shm read failed: %s", strerror(errno));
+        Close();
     }
 }
 
-int JSONRPCServer::StartListen(int worker_num)
+int Client::AttachShm(std::unique_ptr<ShmChannel> shm)
 {
-    if (!Ready())
-        return -1;
+    DLOG();
 
-    if (listen(m_socket, 20) < 0)
-    {
+    if (m_server.m_reactor->AddWatch(shm->Doorbell(), this) < 0)
         return -1;
-    }
 
-    m_ev_base = event_base_new();
+    m_shm = std::move(shm);
+    return 0;
+}
 
-    if (!m_ev_base)
-    {
-        return -1;
-    }
+struct JSONRPCServer::Completion::State
+{
+    State(JSONRPCServer &srv,
+          int cid,
+          const nlohmann::json &id,
+          uint64_t deadline);
+    ~State();
+
+    // false if already completed
+    bool Finish();
+
+    JSONRPCServer &server;
+    int cid;
+    nlohmann::json id;
+    uint64_t deadline;
+
+    std::atomic<bool> done;
+    std::atomic<bool> cancelled;
+};
 
-    m_ev[0] = event_new(m_ev_base,
-                        m_socket,
-                        EV_READ | EV_PERSIST,
-                        OnNewConn,
-                        this);
+struct JSONRPCServer::Running
+{
+    Running(JSONRPCServer &srv, int cid, const nlohmann::json &id);
+    ~Running();
 
-    if (!m_ev[0])
-    {
-        event_base_free(m_ev_base);
-        m_ev_base = NULL;
-        return -1;
-    }
+    JSONRPCServer &server;
+    int cid;
+    const nlohmann::json &id;
 
-    event_add(m_ev[0], NULL);
+    std::atomic<bool> cancelled;
+};
 
-    int ii = 0;
+// bind: options for the listener and those accepted sockets inherit.
+// accept: the rest, per connection
+static int SetSocketOptions(int sock,
+                            const JSONRPCServer::SocketOptions &o,
+                            bool tcp,
+                            bool listener)
+{
+    auto set = [sock](int level, int name, int val) -> int
+    {
+        return setsockopt(sock, level, name, &val, sizeof(val));
+    };
+
+    if (listener)
+    {
+        if ((o.sndbuf && set(SOL_SOCKET, SO_SNDBUF, o.sndbuf) < 0) ||
+            (o.rcvbuf && set(SOL_SOCKET, SO_RCVBUF, o.rcvbuf) < 0))
+        {
+            return -1;
+        }
+
+        if (!tcp)
+            return 0;
+
+        if ((o.defer_accept &&
+             set(IPPROTO_TCP, TCP_DEFER_ACCEPT, o.defer_accept) < 0) ||
+            (o.fastopen &&
+             set(IPPROTO_TCP, TCP_FASTOPEN, o.fastopen) < 0))
+        {
+            return -1;
+        }
+
+        return 0;
+    }
+
+    // accept4 made it non-blocking
+    if (!o.nonblock &&
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK) < 0)
+    {
+        return -1;
+    }
+
+    if (o.busy_poll &&
+        set(SOL_SOCKET, SO_BUSY_POLL, o.busy_poll) < 0)
+    {
+        return -1;
+    }
+
+    if (!tcp)
+        return 0;
+
+    if ((o.nodelay && set(IPPROTO_TCP, TCP_NODELAY, 1) < 0) ||
+        (o.user_timeout &&
+         set(IPPROTO_TCP, TCP_USER_TIMEOUT, o.user_timeout) < 0))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+// TcpExt ListenOverflows from /proc/net/netstat: connections dropped
+// because an accept queue was full, for the whole host
+static int ListenOverflows(uint64_t *n)
+{
+    std::ifstream f("/proc/net/netstat");
+    std::string names, values;
+
+    while (std::getline(f, names) &&
+           std::getline(f, values))
+    {
+        if (names.compare(0, 7, "TcpExt:") != 0)
+            continue;
+
+        std::istringstream ns(names), vs(values);
+        std::string name, value;
+
+        while (ns >> name && vs >> value)
+        {
+            if (name == "ListenOverflows")
+            {
+                *n = strtoull(value.c_str(), NULL, 10);
+                return 0;
+            }
+        }
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+JSONRPCServer::JSONRPCServer()
+    : m_stop(false),
+      m_counter(0),
+      m_shm_ring_size(0),
+      m_inline_budget_us(100),
+      m_backlog(SOMAXCONN),
+      m_accept_batch(64),
+      m_overflow_base(-1),
+      m_output_low(256 * 1024),
+      m_output_high(1024 * 1024),
+      m_max_inflight(0),
+      m_last_tick(0),
+      m_heartbeat(0),
+      m_stall_ms(0)
+{
+    auto *p = new Pool();
+
+    p->threads = 0;
+    p->dispatch = DISPATCH_STRICT;
+
+    for (auto &c : p->credit)
+        c = 0;
+
+    // Post() jobs mostly carry on requests already being served
+    p->lanes[LANE_NORMAL].AddFlow(0, 16, 0);
+
+    m_pools[""].reset(p);
+}
+
+JSONRPCServer::~JSONRPCServer()
+{
+}
+
+int JSONRPCServer::GenUID()
+{
+    int id;
+
+    while (1)
+    {
+        id = ++m_counter;
+
+        if (!id)
+            continue;
+
+        if (HasClient(id))
+            continue;
+
+        break;
+    }
+
+    return id;
+}
+
+bool JSONRPCServer::Ready() const
+{
+    return !m_listeners.empty();
+}
+
+int JSONRPCServer::BindTCP(int port, const SocketOptions &opts)
+{
+    struct addrinfo hints, *res;
+
+    memset(&hints, 0, sizeof(hints));
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (getaddrinfo(NULL,
+                    std::to_string(port).c_str(),
+                    &hints,
+                    &res) != 0)
+    {
+        return -1;
+    }
+
+    int sock = -1;
+
+    do
+    {
+        sock = socket(res->ai_family,
+                      res->ai_socktype,
+                      res->ai_protocol);
+
+        if (sock < 0)
+            break;
+
+        int opt = 1;
+
+        if (setsockopt(sock,
+                       SOL_SOCKET,
+                       SO_REUSEADDR,
+                       &opt, sizeof(opt)) == -1)
+        {
+            break;
+        }
+
+        // non-blocking
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+        if (SetSocketOptions(sock, opts, true, true) < 0)
+            break;
+
+        if (bind(sock,
+                 res->ai_addr,
+                 res->ai_addrlen) < 0)
+        {
+            break;
+        }
+
+        std::unique_ptr<Listener> l(
+            new (std::nothrow) Listener(*this, sock, "", opts));
+
+        if (!l)
+            break;
+
+        freeaddrinfo(res);
+
+        m_listeners.emplace_back(std::move(l));
+        return 0;
+
+    } while (0);
+
+    int err = errno;
+
+    if (sock >= 0)
+    {
+        close(sock);
+    }
+
+    freeaddrinfo(res);
+
+    errno = err;
+    return -1;
+}
+
+int JSONRPCServer::BindUnix(const std::string &path,
+                            const SocketOptions &opts)
+{
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+
+    if (MakeUnixAddr(path, &addr, &addrlen) < 0)
+    {
+        return -1;
+    }
+
+    int sock = -1;
+
+    do
+    {
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (sock < 0)
+            break;
+
+        if (!IsAbstractUnixPath(path))
+        {
+            struct stat st;
+
+            // a socket file left behind by a dead server
+            if (lstat(path.c_str(), &st) == 0)
+            {
+                if (!S_ISSOCK(st.st_mode))
+                {
+                    errno = EADDRINUSE;
+                    break;
+                }
+
+                int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+
+                if (probe < 0)
+                    break;
+
+                int rc = connect(probe,
+                                 (struct sockaddr*) &addr,
+                                 addrlen);
+
+                int err = errno;
+                close(probe);
+
+                if (rc == 0)
+                {
+                    // someone is still listening
+                    errno = EADDRINUSE;
+                    break;
+                }
+
+                if (err == ECONNREFUSED)
+                {
+                    unlink(path.c_str());
+                }
+            }
+        }
+
+        // non-blocking
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+        if (SetSocketOptions(sock, opts, false, true) < 0)
+            break;
+
+        if (bind(sock,
+                 (struct sockaddr*) &addr,
+                 addrlen) < 0)
+        {
+            break;
+        }
+
+        std::unique_ptr<Listener> l(
+            new (std::nothrow) Listener(*this, sock, path, opts));
+
+        if (!l)
+        {
+            errno = ENOMEM;
+            break;
+        }
+
+        m_listeners.emplace_back(std::move(l));
+        return 0;
+
+    } while (0);
+
+    if (sock >= 0)
+    {
+        int err = errno;
+        close(sock);
+        errno = err;
+    }
+
+    return -1;
+}
+
+void JSONRPCServer::Stop()
+{
+    if (m_stop.exchange(true))
+        return;
+
+    for (auto &it : m_pools)
+    {
+        auto &p = *it.second;
+
+        {
+            std::unique_lock<std::mutex>
+                lock(p.lock);
+
+            p.cond.notify_all();
+        }
+
+        for (auto  &w : p.workers)
+        {
+            if (!w.joinable())
+                continue;
+            w.join();
+        }
+    }
+
+    if (m_watchdog.joinable())
+        m_watchdog.join();
+
+    if (m_reactor)
+    {
+        m_reactor->Stop();
+    }
+
+    for (auto &l : m_listeners)
+    {
+        if (l->sock >= 0)
+        {
+            close(l->sock);
+            l->sock = -1;
+        }
+
+        if (!l->path.empty() &&
+            !IsAbstractUnixPath(l->path))
+        {
+            unlink(l->path.c_str());
+        }
+    }
+
+    m_listeners.clear();
+}
+
+int JSONRPCServer::StartListen(int worker_num, Reactor::Backend backend)
+{
+    if (!Ready())
+        return -1;
+
+    for (auto &l : m_listeners)
+    {
+        if (listen(l->sock, m_backlog) < 0)
+        {
+            return -1;
+        }
+    }
+
+    m_reactor.reset(Reactor::Create(backend));
+
+    if (!m_reactor &&
+        backend != Reactor::LIBEVENT)
+    {
+        fprintf(stderr, "%s unavailable (%s), using libevent\n",
+                Reactor::Name(backend),
+                strerror(errno));
+
+        m_reactor.reset(Reactor::Create(Reactor::LIBEVENT));
+    }
+
+    if (!m_reactor)
+    {
+        return -1;
+    }
+
+    // the readiness backends read until EAGAIN, a blocking socket
+    // would hold up the loop on its first idle connection
+    for (auto &l : m_listeners)
+    {
+        if (!l->opts.nonblock &&
+            m_reactor->Type() != Reactor::IO_URING)
+        {
+            fprintf(stderr, "blocking sockets need io_uring, not %s\n",
+                    Reactor::Name(m_reactor->Type()));
+
+            m_reactor.reset();
+
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    m_reactor->SetAcceptBatch(m_accept_batch);
+
+    uint64_t overflows;
+
+    if (ListenOverflows(&overflows) == 0)
+        m_overflow_base = overflows;
+
+    m_reactor->AddTimer(1000, [this] { SampleListeners(); }, true);
+    m_reactor->AddTimer(TICK_MS, [this] { Tick(); }, true);
+
+    m_loop_thread = pthread_self();
+
+    // in-memory time stands still unless advanced by hand
+    if (m_stall_ms > 0 &&
+        m_reactor->Type() != Reactor::MEMORY)
+    {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = OnStallSignal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+
+        sigaction(STALL_SIGNAL, &sa, NULL);
+
+        // backtrace() loads libgcc on first use, not in a handler
+        void *frame;
+        backtrace(&frame, 1);
+
+        m_heartbeat = NowMS();
+        m_watchdog = std::thread([this] { WatchLoop(); });
+    }
+
+    // tcp and unix listeners share the loop
+    for (auto &l : m_listeners)
+    {
+        if (m_reactor->AddListener(l->sock, l.get()) < 0)
+        {
+            return -1;
+        }
+    }
+
+    m_pools[""]->threads = worker_num;
+
+    for (auto &it : m_pools)
+    {
+        auto *p = it.second.get();
+
+        for (int ii = 1; ii <= p->threads; ++ii)
+        {
+            p->workers.emplace_back([this, p, ii]
+            {
+                WorkerLoop(p, ii);
+            });
+        }
+    }
+
+    DLOG("start dispatching on %s ...", Reactor::Name(m_reactor->Type()));
+    return m_reactor->Run();
+}
+
+void JSONRPCServer::WorkerLoop(Pool *p, int ii)
+{
+    DLOG("worker (%s/%d) started", p->name.c_str(), ii);
+
+    auto ready = [p]
+    {
+        for (auto &q : p->lanes)
+        {
+            if (q.Ready())
+                return true;
+        }
+
+        return false;
+    };
+
+    for (;;)
+    {
+        Task t;
+        int flow = 0;
+        int lane;
+
+        {
+            std::unique_lock<std::mutex>
+                lock(p->lock);
+
+            p->cond.wait(
+                lock,
+                [this, &ready]
+                {
+                    return (m_stop || ready());
+                });
+
+            if (m_stop && !ready())
+            {
+                break;
+            }
+
+            DLOG("worker (%s/%d) got a task", p->name.c_str(), ii);
+
+            lane = PickLane(*p);
+            p->lanes[lane].Pop(&t, &flow);
+        }
+
+        if (t.fn)
+            t.fn();
+        else
+            doTask(std::move(t));
+
+        {
+            std::unique_lock<std::mutex>
+                lock(p->lock);
+
+            // the client may be back under its limit
+            if (p->lanes[lane].Done(flow))
+                p->cond.notify_one();
+        }
+    }
+
+    DLOG("worker (%s/%d) stopped", p->name.c_str(), ii);
+}
+
+int JSONRPCServer::PickLane(Pool &p)
+{
+    static const int weights[LANES] = { 8, 4, 1 };
+
+    int best = -1;
+    int total = 0;
+
+    for (int i = 0; i < LANES; ++i)
+    {
+        if (!p.lanes[i].Ready())
+            continue;
+
+        if (p.dispatch == DISPATCH_STRICT)
+            return i;
+
+        // smooth weighted round robin over the lanes with work
+        p.credit[i] += weights[i];
+        total += weights[i];
+
+        if (best < 0 || p.credit[i] > p.credit[best])
+            best = i;
+    }
+
+    if (best >= 0)
+        p.credit[best] -= total;
+
+    return best;
+}
+
+bool JSONRPCServer::Enqueue(Pool &p, int lane, int flow, Task &&t)
+{
+    std::unique_lock<std::mutex>
+        lock(p.lock);
+
+    if (m_stop)
+        return false;
+
+    p.lanes[lane].Push(flow, std::move(t));
+    p.cond.notify_one();
+
+    return true;
+}
+
+Reactor::Backend JSONRPCServer::Backend() const
+{
+    return m_reactor ? m_reactor->Type() : Reactor::LIBEVENT;
+}
+
+Reactor* JSONRPCServer::GetReactor()
+{
+    return m_reactor.get();
+}
+
+int JSONRPCServer::EnableShm(size_t ring_size)
+{
+    if (ring_size == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    m_shm_ring_size = ring_size;
+    return 0;
+}
+
+bool JSONRPCServer::HasMethod(const std::string &name)
+{
+    return m_methods.find(name) != m_methods.end();
+}
+
+void JSONRPCServer::RemoveMethod(const std::string &name)
+{
+    if (!HasMethod(name))
+        return;
+
+    m_methods.erase(name);
+    m_cache.InvalidateMethod(name);
+}
+
+int JSONRPCServer::AddMethod(const std::string &name,
+                             const std::string &desc,
+                             Callback cb,
+                             int flags,
+                             const std::string &pool,
+                             long cache_ttl)
+{
+    if (!cb)
+    {
+        return -1;
+    }
+
+    if (HasMethod(name))
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+    if (!m_pools.count(pool))
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    m_methods.emplace(name,
+                      Method { name, desc, cb, flags, nullptr, pool,
+                               cache_ttl });
+    return 0;
+}
+
+int JSONRPCServer::AddAsyncMethod(const std::string &name,
+                                  const std::string &desc,
+                                  AsyncCallback cb,
+                                  int flags,
+                                  const std::string &pool)
+{
+    if (!cb)
+    {
+        return -1;
+    }
+
+    if (HasMethod(name))
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+    if (!m_pools.count(pool))
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    m_methods.emplace(name,
+                      Method { name, desc, nullptr, flags, cb, pool, 0 });
+    return 0;
+}
+
+int JSONRPCServer::AddBatchMethod(const std::string &name,
+                                  const std::string &desc,
+                                  BatchCallback cb,
+                                  size_t max,
+                                  long window,
+                                  int flags,
+                                  const std::string &pool)
+{
+    if (!cb || !max)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (HasMethod(name))
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+    if (!m_pools.count(pool))
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    Method m { name, desc, nullptr, flags, nullptr, pool, 0 };
+
+    m.batch_cb = cb;
+    m.batch_max = max;
+    m.batch_window = window;
+
+    m_methods.emplace(name, std::move(m));
+    return 0;
+}
+
+int JSONRPCServer::AddAsyncMethod(const std::string &name,
+                                  AsyncCallback cb,
+                                  int flags)
+{
+    return AddAsyncMethod(name, name, cb, flags);
+}
+
+int JSONRPCServer::AddMethod(const std::string &name, Callback cb, int flags)
+{
+    return AddMethod(name, name, cb, flags);
+}
+
+int JSONRPCServer::SetSchema(const std::string &name,
+                             const nlohmann::json &params,
+                             const nlohmann::json &result)
+{
+    auto it = m_methods.find(name);
+
+    if (it == m_methods.end())
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    std::shared_ptr<const Schema> check;
+
+    if (!params.is_null())
+    {
+        check.reset(Schema::Compile(params));
+
+        if (!check)
+            return -1;
+    }
+
+    it->second.params_schema = params;
+    it->second.result_schema = result;
+    it->second.params_check = std::move(check);
+
+    return 0;
+}
+
+int JSONRPCServer::AddPool(const std::string &name,
+                           int threads,
+                           Dispatch dispatch)
+{
+    if (threads < 1)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (m_pools.count(name))
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+    std::unique_ptr<Pool> p(new (std::nothrow) Pool());
+
+    if (!p)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    p->name = name;
+    p->threads = threads;
+    p->dispatch = dispatch;
+
+    for (auto &c : p->credit)
+        c = 0;
+
+    m_pools.emplace(name, std::move(p));
+    return 0;
+}
+
+void JSONRPCServer::SetDispatch(Dispatch dispatch)
+{
+    m_pools[""]->dispatch = dispatch;
+}
+
+void JSONRPCServer::SetCacheSize(size_t bytes)
+{
+    m_cache.SetCapacity(bytes);
+}
+
+void JSONRPCServer::InvalidateCache(const std::string &method)
+{
+    m_cache.InvalidateMethod(method);
+}
+
+void JSONRPCServer::InvalidateCache(const std::string &method,
+                                    const nlohmann::json &params)
+{
+    m_cache.Invalidate(ResultCache::Key(method, params));
+}
+
+void JSONRPCServer::SetInlineBudget(uint64_t usec)
+{
+    m_inline_budget_us = usec;
+}
+
+void JSONRPCServer::SetBacklog(int backlog)
+{
+    m_backlog = std::max(backlog, 1);
+}
+
+void JSONRPCServer::SetWeights(std::function<unsigned(int)> fn)
+{
+    m_weight_fn = std::move(fn);
+}
+
+void JSONRPCServer::SetMaxInflight(unsigned n)
+{
+    m_max_inflight = n;
+}
+
+void JSONRPCServer::SetOutputWatermarks(size_t low, size_t high)
+{
+    m_output_high = std::max<size_t>(high, 1);
+    m_output_low = std::min(low, m_output_high - 1);
+}
+
+void JSONRPCServer::SetAcceptBatch(int n)
+{
+    m_accept_batch = std::max(n, 1);
+}
+
+const JSONRPCServer::Metrics& JSONRPCServer::GetMetrics() const
+{
+    return m_metrics;
+}
+
+void JSONRPCServer::Listener::OnAccept(int conn)
+{
+    ++server.m_metrics.accepted;
+
+    if (SetSocketOptions(conn, opts, path.empty(), false) < 0)
+    {
+        DLOG("socket options: %s", strerror(errno));
+    }
+
+    server.NewClient(conn);
+}
+
+void JSONRPCServer::Listener::OnError(int err)
+{
+    ++server.m_metrics.accept_errors;
+    DLOG("accept failed: %s", strerror(err));
+}
+
+void JSONRPCServer::SampleListeners()
+{
+    for (auto &l : m_listeners)
+    {
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+
+        // not a tcp socket
+        if (getsockopt(l->sock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+            continue;
+
+        // a listener reports its accept queue as unacked
+        uint64_t depth = info.tcpi_unacked;
+
+        if (depth > m_metrics.accept_queue_max)
+            m_metrics.accept_queue_max = depth;
+    }
+
+    uint64_t overflows;
+
+    if (m_overflow_base >= 0 &&
+        ListenOverflows(&overflows) == 0)
+    {
+        m_metrics.accept_overflows = overflows - m_overflow_base;
+    }
+}
+
+void JSONRPCServer::Tick()
+{
+    CheckTraceSignal();
+
+    if (m_reactor->Type() == Reactor::MEMORY)
+        return;
+
+    uint64_t now = Tracer::Now();
+
+    m_heartbeat = now / 1000;
+
+    if (m_last_tick)
+    {
+        uint64_t due = m_last_tick + TICK_MS * 1000;
+        uint64_t lag = (now > due) ? now - due : 0;
+
+        int bucket = 0;
+
+        while (lag >> (bucket + 1) &&
+               bucket < Metrics::LAG_BUCKETS - 1)
+        {
+            ++bucket;
+        }
+
+        ++m_metrics.loop_lag[bucket];
+
+        if (lag > m_metrics.loop_lag_max_us)
+            m_metrics.loop_lag_max_us = lag;
+    }
+
+    m_last_tick = now;
+}
+
+void JSONRPCServer::WatchLoop()
+{
+    long period = std::max(m_stall_ms / 4, 10L);
+
+    // heartbeat a stall was reported at, once per stall
+    uint64_t reported = 0;
+
+    while (!m_stop)
+    {
+        usleep(period * 1000);
+
+        uint64_t beat = m_heartbeat;
+        uint64_t now = NowMS();
+
+        // a tick is due every TICK_MS
+        if (now < beat + TICK_MS + m_stall_ms ||
+            beat == reported)
+        {
+            continue;
+        }
+
+        reported = beat;
+        ++m_metrics.loop_stalls;
+
+        fprintf(stderr, "event loop blocked for %lums\n",
+                (unsigned long) (now - beat - TICK_MS));
+
+        pthread_kill(m_loop_thread, STALL_SIGNAL);
+    }
+}
+
+void JSONRPCServer::SetStallThreshold(long ms)
+{
+    m_stall_ms = std::max(ms, 0L);
+}
+
+void JSONRPCServer::CheckTraceSignal()
+{
+    if (!s_trace_signal)
+        return;
+
+    s_trace_signal = 0;
+
+    if (m_trace_path.empty())
+        return;
+
+    // the file may be large, keep it off the loop
+    std::string path = m_trace_path;
+
+    Post([this, path]
+    {
+        if (DumpTrace(path) < 0)
+            fprintf(stderr, "trace dump to %s failed\n", path.c_str());
+    });
+}
+
+void JSONRPCServer::SetTracing(unsigned sample, const std::string &path)
+{
+    m_tracer.SetSampling(sample);
+    m_trace_path = path;
+
+    if (path.empty())
+        return;
+
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = OnTraceSignal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+
+    sigaction(SIGUSR2, &sa, NULL);
+}
+
+int JSONRPCServer::DumpTrace(const std::string &path)
+{
+    std::ofstream f(path, std::ios::trunc);
+
+    if (!f)
+        return -1;
+
+    f << m_tracer.Dump();
+    f.close();
+
+    return f ? 0 : -1;
+}
+
+void JSONRPCServer::OnReply()
+{
+    std::vector<Reply> replies;
+
+    {
+        std::unique_lock<std::mutex>
+            lock(m_reply_lock);
+
+        replies.swap(m_replies);
+    }
+
+    for (auto &r : replies)
+    {
+        auto *c = GetClient(r.cid);
+
+        if (!c)
+            continue;
+
+        c->Write(std::move(r.frame));
+
+        if (r.trace)
+            c->Traced(r.trace, r.since);
+    }
+}
+
+void JSONRPCServer::RunInLoop(std::function<void()> fn)
+{
+    if (m_reactor->InLoop())
+    {
+        fn();
+        return;
+    }
+
+    m_reactor->Post(std::move(fn));
+}
+
+int JSONRPCServer::Post(std::function<void()> fn)
+{
+    if (!fn)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    Task t;
+
+    t.cid = 0;
+    t.fn = std::move(fn);
+
+    if (!Enqueue(*m_pools[""], LANE_NORMAL, 0, std::move(t)))
+    {
+        errno = ESHUTDOWN;
+        return -1;
+    }
+
+    return 0;
+}
+
+// waits for fd and/or a timeout on the loop, then hands fn to a worker
+class PostJob : public Reactor::Handler
+{
+public:
+    PostJob(JSONRPCServer &srv,
+            Reactor &r,
+            int fd,
+            std::function<void(bool)> fn)
+        : m_server(srv),
+          m_reactor(r),
+          m_fd(fd),
+          m_timer(0),
+          m_fn(std::move(fn))
+    {
+    }
+
+    void Start(long timeout)
+    {
+        if (m_fd >= 0 &&
+            m_reactor.AddWatch(m_fd, this) < 0)
+        {
+            DLOG("watch failed: %s", strerror(errno));
+            m_fd = -1;
+            Finish(false);
+            return;
+        }
+
+        if (timeout >= 0)
+        {
+            m_timer = m_reactor.AddTimer(timeout, [this]
+            {
+                m_timer = 0;
+                Finish(false);
+            });
+        }
+    }
+
+    void OnReadable() override
+    {
+        Finish(true);
+    }
+
+private:
+    void Finish(bool ready)
+    {
+        if (m_fd >= 0)
+            m_reactor.Remove(m_fd);
+
+        if (m_timer)
+            m_reactor.CancelTimer(m_timer);
+
+        auto fn = std::move(m_fn);
+
+        m_server.Post([fn, ready] { fn(ready); });
+
+        delete this;
+    }
+
+    JSONRPCServer &m_server;
+    Reactor &m_reactor;
+    int m_fd;
+    Reactor::TimerId m_timer;
+    std::function<void(bool)> m_fn;
+};
+
+int JSONRPCServer::PostOnReadable(int fd,
+                                  long timeout,
+                                  std::function<void(bool)> fn)
+{
+    if (!fn)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!m_reactor)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    RunInLoop([this, fd, timeout, fn]
+    {
+        (new PostJob(*this, *m_reactor, fd, fn))->Start(timeout);
+    });
+
+    return 0;
+}
+
+int JSONRPCServer::PostAfter(long delay, std::function<void()> fn)
+{
+    if (!fn)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return PostOnReadable(-1,
+                          std::max(delay, 0L),
+                          [fn] (bool) { fn(); });
+}
+
+void JSONRPCServer::OnClientClose(Client *c, void *userdata)
+{
+    DLOG();
+    auto *server = static_cast<JSONRPCServer*>(userdata);
+
+    if (!server)
+        return;
+
+    {
+        std::unique_lock<std::mutex>
+            lock(server->m_pending_lock);
+
+        auto it = server->m_pending.find(c->m_id);
+
+        if (it != server->m_pending.end())
+        {
+            for (auto *state : it->second)
+                state->cancelled = true;
+        }
+
+        auto r = server->m_running.find(c->m_id);
+
+        if (r != server->m_running.end())
+        {
+            for (auto *run : r->second)
+                run->cancelled = true;
+        }
+    }
+
+    server->RemoveClient(c->m_id);
+}
+
+bool JSONRPCServer::HasClient(int cid)
+{
+    return m_clients.find(cid) != m_clients.end();
+}
+
+Client* JSONRPCServer::GetClient(int cid)
+{
+    if (!HasClient(cid))
+        return NULL;
+
+    return m_clients.at(cid).get();
+}
+
+void JSONRPCServer::NewClient(int sock)
+{
+    std::unique_ptr<Client> c(
+        new (std::nothrow) Client(sock, *this)); 
+
+    if (!c)
+    {
+        close(sock);
+        return;
+    }
+
+    if (m_reactor->AddStream(sock, c.get()) < 0)
+    {
+        DLOG("add stream failed: %s", strerror(errno));
+        close(sock);
+        c->m_socket = -1;
+        return;
+    }
+
+    c->m_on_close_cb = OnClientClose;
+    c->m_on_close_param = this;
+
+    unsigned weight = m_weight_fn ? m_weight_fn(sock) : 1;
+
+    for (auto &it : m_pools)
+    {
+        auto &p = *it.second;
+
+        std::unique_lock<std::mutex>
+            lock(p.lock);
+
+        for (auto &q : p.lanes)
+            q.AddFlow(c->m_id, weight, m_max_inflight);
+    }
+
+    m_clients.emplace(c->m_id, std::move(c));
+}
+
+void JSONRPCServer::RemoveClient(int cid)
+{
+    if (!HasClient(cid))
+        return;
+
+    for (auto &topic : m_clients.at(cid)->m_topics)
+    {
+        auto it = m_topics.find(topic);
+
+        if (it == m_topics.end())
+            continue;
+
+        it->second.erase(cid);
+
+        if (it->second.empty())
+            m_topics.erase(it);
+    }
+
+    DLOG("remaining: %ld", m_clients.size());
+    m_clients.erase(cid);
+    DLOG("remaining: %ld", m_clients.size());
+
+    // nobody would read the replies of what it has queued
+    for (auto &it : m_pools)
+    {
+        auto &p = *it.second;
+
+        std::unique_lock<std::mutex>
+            lock(p.lock);
+
+        for (auto &q : p.lanes)
+        {
+            m_metrics.cancelled += q.Clear(cid);
+            q.RemoveFlow(cid);
+        }
+    }
+}
+
+inline bool HasKey(nlohmann::json &j, const char *key)
+{
+    return j.find(key) != j.end();
+}
+
+inline nlohmann::json MakeError(const nlohmann::json &id,
+                                int code,
+                                const char *msg)
+{
+    return nlohmann::json(
+            {
+                { "jsonrpc", "2.0" },
+                { "id", id },
+                { "error",
+                    {
+                        { "code", code },
+                        { "message", msg },
+                    }
+                },
+            });
+}
+
+// id of a request, null if it has none or isn't one
+inline nlohmann::json IdOf(const nlohmann::json &req)
+{
+    if (!req.is_object())
+        return nullptr;
+
+    auto it = req.find("id");
+
+    return (it != req.end()) ? *it : nlohmann::json();
+}
+
+inline nlohmann::json MakeResult(const nlohmann::json &id,
+                                 const nlohmann::json &j)
+{
+    return nlohmann::json(
+            {
+                { "jsonrpc", "2.0" },
+                { "id", id },
+                { "result", j },
+            });
+}
+
+int JSONRPCServer::UpgradeShm(int cid, nlohmann::json &req)
+{
+    auto *c = GetClient(cid);
+
+    if (!c)
+        return -1;
+
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+
+    if (!m_shm_ring_size ||
+        c->m_shm ||
+        !c->m_output.Empty() ||
+        getsockname(c->m_socket,
+                    (struct sockaddr*) &addr,
+                    &addrlen) < 0 ||
+        addr.ss_family != AF_UNIX)
+    {
+        doReply(cid,
+                MakeError(req["id"], -32600, "Invalid Request."));
+        return -1;
+    }
+
+    std::unique_ptr<ShmChannel> shm(
+        new (std::nothrow) ShmChannel(ShmChannel::SERVER));
+
+    if (!shm ||
+        shm->Create(m_shm_ring_size) < 0)
+    {
+        DLOG("shm create failed: %s", strerror(errno));
+        doReply(cid,
+                MakeError(req["id"], -32603, "Internal error."));
+        return -1;
+    }
+
+    std::string s = MakeResult(req["id"],
+                               { { "ring", shm->RingSize() } }).dump();
+
+    // only a huge id gets there
+    if (s.size() > MAX_PAYLOAD)
+    {
+        doReply(cid,
+                MakeError(nullptr, -32600, "Invalid Request."));
+        return -1;
+    }
+
+    uint16_t datalen = htons(s.size());
+    s.insert(0, (char*) &datalen, 2);
+
+    // the reply carries the memfd and doorbells
+    if (shm->SendFds(c->m_socket, s.data(), s.size()) != (int) s.size())
+    {
+        DLOG("shm handshake failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (c->AttachShm(std::move(shm)) < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int JSONRPCServer::Push(int cid,
+                        const char *data,
+                        unsigned int datalen,
+                        uint64_t recv_us)
+{
+    DLOG("%s: %d", data, datalen);
+
+    Task t;
+
+    if (m_stop)
+    {
+        return -1;
+    }
+
+    t.cid = cid;
+
+    try
+    {
+        t.req = nlohmann::json::parse(
+                  std::string(data, datalen));
+
+        if (!t.req.is_object() ||
+            !HasKey(t.req, "jsonrpc") ||
+            !HasKey(t.req, "method") ||
+            !t.req["method"].is_string())
+        {
+            doReply(t.cid,
+                    MakeError(IdOf(t.req), -32600, "Invalid Request."));
+            return 0;
+        }
+
+        if (t.req["jsonrpc"] != "2.0")
+        {
+            doReply(t.cid,
+                    MakeError(IdOf(t.req), -32600, "Invalid Request."));
+            return 0;
+        }
+
+        auto id = t.req.find("id");
+
+        if (id != t.req.end() &&
+            !id->is_number() &&
+            id->dump().size() > MAX_ID_SIZE)
+        {
+            doReply(t.cid,
+                    MakeError(nullptr, -32600, "Invalid Request."));
+            return 0;
+        }
+
+        if (t.req["method"] == "$/shm" &&
+            HasKey(t.req, "id"))
+        {
+            return UpgradeShm(t.cid, t.req);
+        }
+
+        if (t.req["method"] == "$/cancelRequest")
+        {
+            auto params = t.req.find("params");
+
+            if (params != t.req.end() &&
+                params->is_object() &&
+                HasKey(*params, "id"))
+            {
+                CancelRequest(cid, (*params)["id"]);
+            }
+
+            // meant as a notification, but don't leave a caller hanging
+            if (HasKey(t.req, "id"))
+                doReply(cid, MakeResult(t.req["id"], true));
+
+            return 0;
+        }
+
+        // "rpc." names are reserved for the server itself
+        if (t.req["method"] == "rpc.discover")
+        {
+            if (HasKey(t.req, "id"))
+                doReply(cid, MakeResult(t.req["id"], Discover()));
+
+            return 0;
+        }
+
+        if (t.req["method"] == "rpc.subscribe" ||
+            t.req["method"] == "rpc.unsubscribe")
+        {
+            auto &params = t.req["params"];
+            int rc = -1;
+
+            if (params.is_object() &&
+                params["topic"].is_string())
+            {
+                rc = Subscribe(cid,
+                               params["topic"],
+                               t.req["method"] == "rpc.subscribe");
+            }
+
+            if (HasKey(t.req, "id"))
+            {
+                doReply(cid,
+                        (rc < 0) ?
+                        MakeError(t.req["id"], -32602, "Invalid params.") :
+                        MakeResult(t.req["id"], true));
+            }
+
+            return 0;
+        }
+
+        if (!HasMethod(t.req["method"]))
+        {
+            doReply(t.cid,
+                    MakeError(IdOf(t.req), -32601, "Method not found."));
+            return 0;
+        }
+
+        bool is_notificaiton = !HasKey(t.req, "id");
+
+        // the caller's budget, counted from here
+        auto timeout = t.req.find("timeout");
+
+        if (timeout != t.req.end() &&
+            timeout->is_number() &&
+            *timeout > 0)
+        {
+            // 0.5 is half a millisec, not none at all
+            double ms = std::min(ceil(timeout->get<double>()),
+                                 MAX_TIMEOUT_MS);
+
+            t.deadline = NowMS() + (uint64_t) ms;
+        }
+
+        auto &m = m_methods.at(t.req["method"]);
+
+        std::string err;
+
+        if (m.params_check &&
+            !m.params_check->Validate(t.req["params"], &err))
+        {
+            // not worth a queue slot and a worker wakeup
+            ++m_metrics.invalid_params;
+
+            if (!is_notificaiton)
+            {
+                auto e = MakeError(t.req["id"], -32602, "Invalid params.");
+
+                e["error"]["data"] = "params" + err;
+                doReply(cid, std::move(e));
+            }
+
+            return 0;
+        }
+
+        if (m.batch_cb)
+        {
+            if (!is_notificaiton)
+            {
+                auto e = MakeError(t.req["id"], -32600, "Invalid Request.");
+
+                e["error"]["data"] = "notifications only";
+                doReply(cid, std::move(e));
+                return 0;
+            }
+
+            AddToBatch(m, std::move(t.req["params"]));
+            return 0;
+        }
+
+        if (m.cache_ttl)
+        {
+            t.key = ResultCache::Key(m.name, t.req["params"]);
+
+            auto hit = m_cache.Get(t.key);
+
+            if (hit)
+            {
+                // neither the handler nor dump()
+                ++m_metrics.cache_hits;
+
+                if (!is_notificaiton)
+                    doReply(cid, t.req["id"], *hit);
+
+                return 0;
+            }
+
+            ++m_metrics.cache_misses;
+            t.cache_epoch = m_cache.Epoch();
+        }
+
+        t.trace = m_tracer.Sample();
+
+        if (t.trace)
+        {
+            t.queued = Tracer::Now();
+            m_tracer.Record(t.trace, "parse", recv_us ? recv_us : t.queued,
+                            t.queued);
+        }
+
+        if (m.flags & METHOD_INLINE)
+        {
+            // cheaper than a round trip through the workers
+            doInline(m, std::move(t));
+            return 0;
+        }
+
+        int lane = (m.flags & METHOD_HIGH) ? LANE_HIGH :
+                   (m.flags & METHOD_LOW) ? LANE_LOW : LANE_NORMAL;
+
+        if (!Enqueue(*m_pools.at(m.pool), lane, cid, std::move(t)))
+            return -1;
+
+        return 0;
+    }
+    catch (nlohmann::json::parse_error &e)
+    {
+        doReply(cid,
+                MakeError(nullptr, -32700, "Parse Error"));
+        return 0;
+    }
+    catch (nlohmann::json::exception &e)
+    {
+        // a member of the wrong type
+        doReply(cid,
+                MakeError(IdOf(t.req), -32600, "Invalid Request."));
+        return 0;
+    }
+}
+
+void JSONRPCServer::CancelRequest(int cid, const nlohmann::json &id)
+{
+    if (id.is_null())
+        return;
+
+    auto match = [&id] (const Task &t)
+    {
+        return (IdOf(t.req) == id);
+    };
+
+    for (auto &it : m_pools)
+    {
+        auto &p = *it.second;
+
+        Task t;
+        bool found = false;
+
+        {
+            std::unique_lock<std::mutex>
+                lock(p.lock);
+
+            for (auto &q : p.lanes)
+            {
+                if (q.Erase(cid, match, &t))
+                {
+                    found = true;
+                    break;
+                }
+            }
+        }
+
+        if (found)
+        {
+            // never ran, but the caller still gets an answer
+            ++m_metrics.cancelled;
+
+            doReply(cid,
+                    MakeError(id, -32800, "Request cancelled."));
+            return;
+        }
+    }
+
+    // on a worker already, up to the handler to notice
+    std::unique_lock<std::mutex>
+        lock(m_pending_lock);
+
+    auto r = m_running.find(cid);
+
+    if (r != m_running.end())
+    {
+        for (auto *run : r->second)
+        {
+            if (run->id == id)
+                run->cancelled = true;
+        }
+    }
+
+    auto pending = m_pending.find(cid);
+
+    if (pending != m_pending.end())
+    {
+        for (auto *state : pending->second)
+        {
+            if (state->id == id)
+                state->cancelled = true;
+        }
+    }
+}
+
+int JSONRPCServer::Subscribe(int cid, const std::string &topic, bool on)
+{
+    auto *c = GetClient(cid);
+
+    if (!c || topic.empty())
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (on)
+    {
+        m_topics[topic].insert(cid);
+        c->m_topics.insert(topic);
+        return 0;
+    }
+
+    c->m_topics.erase(topic);
+
+    auto it = m_topics.find(topic);
+
+    if (it == m_topics.end())
+        return 0;
+
+    it->second.erase(cid);
+
+    if (it->second.empty())
+        m_topics.erase(it);
+
+    return 0;
+}
+
+int JSONRPCServer::Publish(const std::string &topic,
+                           const nlohmann::json &params)
+{
+    if (topic.empty())
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!m_reactor)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    std::string s(2, '\0');
+
+    // once, whatever the number of subscribers
+    s += nlohmann::json(
+            {
+                { "jsonrpc", "2.0" },
+                { "method", topic },
+                { "params", params },
+            }).dump();
+
+    if (s.size() - 2 > MAX_PAYLOAD)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    uint16_t datalen = htons(s.size() - 2);
+
+    memcpy(&s[0], &datalen, 2);
+
+    BufferChain::Segment frame =
+        std::make_shared<const std::string>(std::move(s));
+
+    RunInLoop([this, topic, frame]
+    {
+        auto it = m_topics.find(topic);
+
+        if (it == m_topics.end())
+            return;
+
+        for (int cid : it->second)
+        {
+            auto *c = GetClient(cid);
+
+            if (!c)
+                continue;
+
+            // events pile up for a peer that isn't reading, drop them
+            if (c->m_paused)
+            {
+                ++m_metrics.publish_dropped;
+                continue;
+            }
+
+            c->Write(frame);
+            ++m_metrics.published;
+        }
+    });
+
+    return 0;
+}
+
+void JSONRPCServer::AddToBatch(const Method &m, nlohmann::json &&params)
+{
+    auto &b = m_batches[m.name];
+
+    b.params.push_back(std::move(params));
+    ++m_metrics.batched;
+
+    if (b.params.size() >= m.batch_max)
+    {
+        FlushBatch(m.name);
+        return;
+    }
+
+    // the window opens with the first of a batch
+    if (b.params.size() == 1 &&
+        m.batch_window > 0)
+    {
+        std::string name = m.name;
+
+        b.timer = m_reactor->AddTimer(m.batch_window,
+                                      [this, name]
+                                      {
+                                          m_batches[name].timer = 0;
+                                          FlushBatch(name);
+                                      });
+    }
+}
+
+void JSONRPCServer::FlushBatch(const std::string &name)
+{
+    auto it = m_batches.find(name);
+
+    if (it == m_batches.end())
+        return;
+
+    auto &b = it->second;
+
+    if (b.timer)
+    {
+        m_reactor->CancelTimer(b.timer);
+        b.timer = 0;
+    }
+
+    auto m = m_methods.find(name);
+
+    if (m == m_methods.end() ||
+        b.params.empty())
+    {
+        // the method is gone
+        m_batches.erase(it);
+        return;
+    }
+
+    auto params = std::make_shared<std::vector<nlohmann::json>>();
+
+    params->swap(b.params);
+
+    // for the next one, about the same size
+    b.params.reserve(params->size());
+
+    Task t;
+    auto cb = m->second.batch_cb;
 
-    while (worker_num--)
+    t.cid = 0;
+    t.fn = [cb, params] { cb(*params); };
+
+    int flags = m->second.flags;
+    int lane = (flags & METHOD_HIGH) ? LANE_HIGH :
+               (flags & METHOD_LOW) ? LANE_LOW : LANE_NORMAL;
+
+    if (Enqueue(*m_pools.at(m->second.pool), lane, 0, std::move(t)))
+        ++m_metrics.batches;
+}
+
+nlohmann::json JSONRPCServer::Discover()
+{
+    nlohmann::json methods = nlohmann::json::array();
+
+    for (auto &it : m_methods)
     {
-        ++ii;
+        auto &m = it.second;
 
-        m_workers.emplace_back([ii, this]
+        nlohmann::json j =
         {
-            DLOG("worker (%d) started", ii);
+            { "name", m.name },
+            { "description", m.desc },
+            { "async", (bool) m.async_cb },
+            { "pool", m.pool },
+        };
 
-            for (;;)
-            {
-                Task t;
+        if (!m.params_schema.is_null())
+            j["params"] = m.params_schema;
 
-                {
-                    std::unique_lock<std::mutex>
-                        lock(this->m_task_lock);
-
-                    this->m_task_cond.wait(
-                        lock,
-                        [this]
-                        {
-                            return (this->m_stop ||
-                                    !this->m_tasks.empty());
-                        });
-
-                    if (this->m_stop &&
-                        this->m_tasks.empty())
-                    {
-                        break;
-                    }
+        if (!m.result_schema.is_null())
+            j["result"] = m.result_schema;
 
-                    DLOG("worker (%d) got a task", ii);
+        // callers may repeat or share these
+        if (m.cache_ttl)
+            j["cached"] = true;
 
-                    t = std::move(m_tasks.front());
-                    m_tasks.pop();
-                }
+        if (m.flags & METHOD_COALESCE)
+            j["coalesced"] = true;
 
-                doTask(std::move(t));
-            }
+        // notifications only, no result
+        if (m.batch_cb)
+            j["batch"] = true;
 
-            DLOG("worker (%d) stopped", ii);
-        });
+        methods.push_back(std::move(j));
     }
 
-    DLOG("start dispatching ...");
-    event_base_dispatch(m_ev_base);
-
-    return 0;
+    return { { "methods", std::move(methods) } };
 }
 
-bool JSONRPCServer::HasMethod(const std::string &name)
+void JSONRPCServer::doInline(const Method &m, Task &&t)
 {
-    return m_methods.find(name) != m_methods.end();
+    auto start = std::chrono::steady_clock::now();
+
+    doTask(std::move(t));
+
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::steady_clock::now() - start).count();
+
+    ++m_metrics.inline_calls;
+
+    uint64_t max = m_metrics.inline_max_us.load();
+
+    while (us > max &&
+           !m_metrics.inline_max_us.compare_exchange_weak(max, us))
+        ;
+
+    if (us > m_inline_budget_us)
+    {
+        // every connection waited for this one
+        ++m_metrics.inline_slow;
+
+        fprintf(stderr, "inline method %s took %luus (budget %luus)\n",
+                m.name.c_str(),
+                (unsigned long) us,
+                (unsigned long) m_inline_budget_us);
+    }
 }
 
-void JSONRPCServer::RemoveMethod(const std::string &name)
+void JSONRPCServer::doTask(Task &&t)
 {
-    if (!HasMethod(name))
+    auto &req = t.req;
+    auto &resp = t.resp;
+
+    auto it = m_methods.find(req["method"]);
+
+    if (it == m_methods.end())
         return;
 
-    m_methods.erase(name);
-}
+    auto &m = it->second;
 
-int JSONRPCServer::AddMethod(const std::string &name, const std::string &desc, Callback cb)
-{
-    if (!cb)
+    if (t.trace)
+        m_tracer.Record(t.trace, "queue", t.queued, Tracer::Now());
+
+    if (t.deadline &&
+        NowMS() >= t.deadline)
     {
-        return -1;
+        // sat in the queue until the caller gave up
+        ++m_metrics.expired;
+
+        if (!req["id"].is_null())
+        {
+            doReply(t.cid,
+                    MakeError(req["id"], -32001, "Deadline exceeded."));
+        }
+
+        return;
     }
 
-    if (HasMethod(name))
+    if (m.async_cb)
     {
-        errno = EEXIST;
-        return -1;
+        std::shared_ptr<Completion::State> state(
+            new Completion::State(*this, t.cid, req["id"], t.deadline));
+
+        m.async_cb(req["params"], Completion(state));
+        return;
     }
 
-    m_methods.emplace(name, Method { name, desc, cb});
-    return 0;
-}
+    bool coalesce = (m.flags & METHOD_COALESCE);
 
-int JSONRPCServer::AddMethod(const std::string &name, Callback cb)
-{
-    return AddMethod(name, name, cb);
-}
+    if (coalesce)
+    {
+        if (t.key.empty())
+            t.key = ResultCache::Key(m.name, req["params"]);
 
-void JSONRPCServer::OnNewConn(int ,short, void *userdata)
-{
-    auto *server = static_cast<JSONRPCServer*>(userdata);
+        std::unique_lock<std::mutex>
+            lock(m_flight_lock);
 
-    if (!server)
-        return;
+        auto it = m_flights.find(t.key);
 
-    struct sockaddr_storage addr;
-    socklen_t addrlen = sizeof(addr);
+        if (it != m_flights.end())
+        {
+            // running already, wait for its result instead
+            it->second.emplace_back(t.cid, req["id"]);
+            ++m_metrics.coalesced;
+            return;
+        }
+
+        m_flights[t.key];
+    }
+
+    Running run(*this, t.cid, req["id"]);
+
+    t_deadline = t.deadline;
+
+    // a coalesced call is not its first caller's alone to cancel
+    t_cancelled = coalesce ? NULL : &run.cancelled;
+
+    uint64_t start = t.trace ? Tracer::Now() : 0;
+
+    int rc = m.cb(req["params"], resp);
 
-    int sock = accept(server->m_socket,
-                      (struct sockaddr*) &addr,
-                      &addrlen);
+    if (t.trace)
+        m_tracer.Record(t.trace, "handler", start, Tracer::Now());
 
-    if (sock < 0)
+    t_cancelled = NULL;
+    t_deadline = 0;
+
+    // replies made from here on are this request's
+    t_trace = t.trace;
+
+    std::vector<std::pair<int, nlohmann::json>> waiters;
+
+    if (coalesce)
+    {
+        std::unique_lock<std::mutex>
+            lock(m_flight_lock);
+
+        auto it = m_flights.find(t.key);
+
+        waiters.swap(it->second);
+        m_flights.erase(it);
+    }
+
+    if (rc < 0 ||
+        t.key.empty())
     {
+        doResult(t.cid, req["id"], rc, resp);
+
+        t_trace = 0;
+
+        for (auto &w : waiters)
+            doResult(w.first, w.second, rc, resp);
+
         return;
     }
 
-    server->NewClient(sock);
+    start = t.trace ? Tracer::Now() : 0;
+
+    // serialized once, for every reply and the cache hits to come
+    ResultCache::Result result = std::make_shared<const std::string>(
+        resp.is_null() ? std::string("true") : resp.dump());
+
+    if (t.trace)
+        m_tracer.Record(t.trace, "serialize", start, Tracer::Now());
+
+    if (m.cache_ttl)
+        m_cache.Put(t.key, result, m.cache_ttl, t.cache_epoch);
+
+    if (!req["id"].is_null())
+        doReply(t.cid, req["id"], *result);
+
+    t_trace = 0;
+
+    for (auto &w : waiters)
+    {
+        if (!w.second.is_null())
+            doReply(w.first, w.second, *result);
+    }
 }
 
-void JSONRPCServer::OnClientClose(Client *c, void *userdata)
+void JSONRPCServer::doResult(int cid,
+                             const nlohmann::json &id,
+                             int rc,
+                             const nlohmann::json &resp)
 {
-    DLOG();
-    auto *server = static_cast<JSONRPCServer*>(userdata);
+    if (id.is_null())
+    {
+        // notification
+        return;
+    }
 
-    if (!server)
+    if (rc < 0)
+    {
+        doReply(cid,
+                MakeError(id, rc, "do task failed"));
+        return;
+    }
+
+    if (resp.is_null())
+    {
+        doReply(cid,
+                MakeResult(id, true));
         return;
+    }
 
-    server->RemoveClient(c->m_id);
+    doReply(cid,
+            MakeResult(id, resp));
+    return;
 }
 
-bool JSONRPCServer::HasClient(int cid)
+JSONRPCServer::Completion::State::State(JSONRPCServer &srv,
+                                        int c,
+                                        const nlohmann::json &i,
+                                        uint64_t d)
+    : server(srv),
+      cid(c),
+      id(i),
+      deadline(d),
+      done(false),
+      cancelled(false)
 {
-    return m_clients.find(cid) != m_clients.end();
+    std::unique_lock<std::mutex>
+        lock(server.m_pending_lock);
+
+    server.m_pending[cid].insert(this);
+    ++server.m_metrics.async_pending;
 }
 
-Client* JSONRPCServer::GetClient(int cid)
+JSONRPCServer::Completion::State::~State()
 {
-    if (!HasClient(cid))
-        return NULL;
-
-    return m_clients.at(cid).get();
+    if (Finish())
+    {
+        // handler dropped the token
+        server.doResult(cid, id, -32603, nullptr);
+    }
 }
 
-void JSONRPCServer::NewClient(int sock)
+bool JSONRPCServer::Completion::State::Finish()
 {
-    std::unique_ptr<Client> c(
-        new (std::nothrow) Client(sock, *this)); 
+    if (done.exchange(true))
+        return false;
 
-    if (!c)
-        return;
+    std::unique_lock<std::mutex>
+        lock(server.m_pending_lock);
 
-    c->m_ev[0] = event_new(m_ev_base,
-                           c->m_socket,
-                           EV_READ | EV_PERSIST,
-                           Client::OnRead,
-                           c.get());
+    auto it = server.m_pending.find(cid);
 
-    if (!c->m_ev[0])
-        return;
+    if (it != server.m_pending.end())
+    {
+        it->second.erase(this);
 
-    c->m_ev[1] = event_new(m_ev_base,
-                           c->m_socket,
-                           EV_WRITE | EV_PERSIST,
-                           Client::OnWrite,
-                           c.get());
+        if (it->second.empty())
+            server.m_pending.erase(it);
+    }
 
-    if (!c->m_ev[1])
-        return;
+    --server.m_metrics.async_pending;
+    return true;
+}
 
-    c->m_on_close_cb = OnClientClose;
-    c->m_on_close_param = this;
-    
-    // add read event
-    event_add(c->m_ev[0], NULL);
+JSONRPCServer::Running::Running(JSONRPCServer &srv,
+                                int c,
+                                const nlohmann::json &i)
+    : server(srv),
+      cid(c),
+      id(i),
+      cancelled(false)
+{
+    std::unique_lock<std::mutex>
+        lock(server.m_pending_lock);
 
-    m_clients.emplace(c->m_id, std::move(c));
+    server.m_running[cid].insert(this);
 }
 
-void JSONRPCServer::RemoveClient(int cid)
+JSONRPCServer::Running::~Running()
 {
-    if (!HasClient(cid))
-        return;
+    std::unique_lock<std::mutex>
+        lock(server.m_pending_lock);
 
-    DLOG("remaining: %ld", m_clients.size());
-    m_clients.erase(cid);
-    DLOG("remaining: %ld", m_clients.size());
+    auto it = server.m_running.find(cid);
+
+    if (it != server.m_running.end())
+    {
+        it->second.erase(this);
+
+        if (it->second.empty())
+            server.m_running.erase(it);
+    }
 }
 
-inline bool HasKey(nlohmann::json &j, const char *key)
+JSONRPCServer::Completion::Completion()
 {
-    return j.find(key) != j.end();
 }
 
-inline nlohmann::json MakeError(int code, const char *msg)
+JSONRPCServer::Completion::Completion(std::shared_ptr<State> state)
+    : m_state(std::move(state))
 {
-    return nlohmann::json(
-            {
-                { "jsonrpc", "2.0" },
-                { "id", NULL },
-                { "error",
-                    nlohmann::json(
-                    {
-                        "code", code,
-                        "message", msg,
-                    }
-                )},
-            });
 }
 
-inline nlohmann::json MakeResult(int id, const nlohmann::json &j)
+bool JSONRPCServer::Completion::Done(const nlohmann::json &result)
 {
-    return nlohmann::json(
-            {
-                { "jsonrpc", "2.0" },
-                { "id", id },
-                { "result", j },
-            });
+    if (!m_state || !m_state->Finish())
+        return false;
+
+    m_state->server.doResult(m_state->cid, m_state->id, 0, result);
+    return true;
 }
 
-int JSONRPCServer::Push(int cid, const char *data, unsigned int datalen)
+bool JSONRPCServer::Completion::Fail(int code, const std::string &msg)
 {
-    DLOG("%s: %d", data, datalen);
-
-    Task t;
+    if (!m_state || !m_state->Finish())
+        return false;
 
-    std::unique_lock<std::mutex>
-        lock(m_task_lock);
+    if (m_state->id.is_null())
+        return true;
 
-    if (m_stop)
-    {
-        return -1;
-    }
+    m_state->server.doReply(m_state->cid,
+                            MakeError(m_state->id, code, msg.c_str()));
+    return true;
+}
 
-    t.cid = cid;
+bool JSONRPCServer::Completion::Cancelled() const
+{
+    return (!m_state || m_state->cancelled);
+}
 
-    try
-    {
-        t.req = nlohmann::json::parse(
-                  std::string(data, datalen));
+long JSONRPCServer::Completion::TimeLeft() const
+{
+    return m_state ? oolong::TimeLeft(m_state->deadline) : -1;
+}
 
-        if (!HasKey(t.req, "jsonrpc") ||
-            !HasKey(t.req, "method"))
-        {
-            doReply(t.cid,
-                    MakeError(-32600, "Invalid Request."));
-            return -1;
-        }
+long JSONRPCServer::TimeLeft()
+{
+    return oolong::TimeLeft(t_deadline);
+}
 
-        if (t.req["jsonrpc"] != "2.0")
-        {
-            doReply(t.cid,
-                    MakeError(-32600, "Invalid Request."));
-            return -1;
-        }
+bool JSONRPCServer::Cancelled()
+{
+    return (t_cancelled && *t_cancelled);
+}
 
-        if (!HasMethod(t.req["method"]))
-        {
-            doReply(t.cid,
-                    MakeError(-32601, "Method not found."));
-            return -1;
-        }
+void JSONRPCServer::doReply(int cid, nlohmann::json &&r)
+{
+    std::string s(2, '\0');
+    uint64_t start = t_trace ? Tracer::Now() : 0;
 
-        bool is_notificaiton = !HasKey(t.req, "id");
+    s += r.dump();
 
-        m_tasks.push(t);
-        m_task_cond.notify_one();
+    if (t_trace)
+        m_tracer.Record(t_trace, "serialize", start, Tracer::Now());
 
-        return (is_notificaiton) ? -1 : 0;
-    }
-    catch (nlohmann::json::parse_error &e)
+    if (s.size() - 2 > MAX_PAYLOAD)
     {
-        doReply(cid,
-                MakeError(-32700, "Parse Error"));
-        return -1;
-    }
-}
-
-void JSONRPCServer::doTask(Task &&t)
-{
-    auto *c = GetClient(t.cid);
+        nlohmann::json id = IdOf(r);
 
-    if (!c)
-        return;
-
-    auto &req = t.req;
-    auto &resp = t.resp;
+        // the id may be what is too large, never twice
+        if (id.dump().size() > MAX_ID_SIZE)
+            id = nullptr;
 
-    auto &m = m_methods[req["method"]];
+        s.resize(2);
+        s += MakeError(id, -32603, "Response too large.").dump();
+    }
 
-    int rc = m.cb(req["params"], resp);
+    doSend(cid, std::move(s));
+}
 
-    if (!HasKey(req, "id"))
+void JSONRPCServer::doReply(int cid,
+                            const nlohmann::json &id,
+                            const std::string &result)
+{
+    std::string s(2, '\0');
+    std::string i = id.dump();
+
+    // as MakeResult() would dump, keys sorted
+    s.reserve(2 + 40 + i.size() + result.size());
+    s += "{\"id\":";
+    s += i;
+    s += ",\"jsonrpc\":\"2.0\",\"result\":";
+    s += result;
+    s += '}';
+
+    // the envelope and id count too
+    if (s.size() - 2 > MAX_PAYLOAD)
     {
-        // notification
+        doReply(cid, MakeError(id, -32603, "Response too large."));
         return;
     }
 
-    auto &id = req["id"];
+    doSend(cid, std::move(s));
+}
 
-    if (rc < 0)
+void JSONRPCServer::doSend(int cid, std::string &&s)
+{
+    // a cut length would garble every frame after it. doReply() and
+    // Publish() check first, this only guards against a missed case
+    if (s.size() - 2 > MAX_PAYLOAD)
     {
-        doReply(t.cid,
-                MakeError(rc, "do task failed"));
+        DLOG("frame of %zu dropped", s.size() - 2);
         return;
     }
 
-    if (resp.is_null())
+    uint16_t datalen = htons(s.size() - 2);
+
+    memcpy(&s[0], &datalen, 2);
+
+    if (m_reactor->InLoop())
     {
-        doReply(t.cid,
-                MakeResult(id, true));
-        return;
-    }
+        auto *c = GetClient(cid);
 
-    doReply(t.cid,
-            MakeResult(id, resp));
-    return;
-}
+        if (!c)
+            return;
 
-void JSONRPCServer::doReply(int cid, nlohmann::json &&r)
-{
-    auto *c = GetClient(cid);
+        c->Write(std::move(s));
+
+        if (t_trace)
+            c->Traced(t_trace, Tracer::Now());
 
-    if (!c)
         return;
+    }
 
-    std::string s = r.dump();
-    uint16_t datalen = htons(s.size());
+    uint64_t since = t_trace ? Tracer::Now() : 0;
 
-    c->Write((char*) &datalen, 2);
-    c->Write(s.c_str(), s.size());
+    // clients belong to the event loop thread
+    std::unique_lock<std::mutex>
+        lock(m_reply_lock);
 
-    c->CloseOnEmpty();
+    // one loop job per batch
+    if (m_replies.empty())
+        m_reactor->Post([this] { OnReply(); });
 
-    return;
+    m_replies.push_back(Reply { cid, std::move(s), t_trace, since });
 }
 
 OOLONG_NS_END
@@ -8,13 +8,21 @@
 #include <condition_variable>
 #include <queue>
 #include <map>
-
-#include <event2/event.h>
+#include <atomic>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <functional>
 
 #include "json.hpp"
 
 #include "oolong.h"
 #include "buffer/buffer.h"
+#include "reactor/reactor.h"
+#include "fair_queue.h"
+#include "result_cache.h"
+#include "tracer.h"
+#include "schema.h"
 
 OOLONG_NS_BEGIN
 
@@ -26,11 +34,203 @@ public:
     typedef int (*Callback)(const nlohmann::json &params,
                             nlohmann::json &result);
 
+    // completion token of a deferred request, may be fulfilled later
+    // from any thread. the first Done/Fail wins, a token dropped
+    // without either replies with an error.
+    class Completion
+    {
+    public:
+        struct State;
+
+        Completion();
+        Completion(std::shared_ptr<State> state);
+
+        bool Done(const nlohmann::json &result);
+
+        bool Fail(int code, const std::string &msg);
+
+        // the caller cancelled the request, or is gone and the
+        // result would be dropped
+        bool Cancelled() const;
+
+        // millisec until the caller gives up, < 0 if it didn't say
+        long TimeLeft() const;
+
+    private:
+        std::shared_ptr<State> m_state;
+    };
+
+    typedef std::function<void(const nlohmann::json &params,
+                               Completion c)> AsyncCallback;
+
+    // params of a batch of notifications, in arrival order. may be
+    // moved from
+    typedef std::function<void(std::vector<nlohmann::json> &params)>
+        BatchCallback;
+
+    enum MethodFlag
+    {
+        // non-blocking handler, run on the event loop thread and
+        // reply right away instead of going through the workers
+        METHOD_INLINE = 0x01,
+
+        // priority lane in the method's pool, normal if neither
+        METHOD_HIGH = 0x02,
+        METHOD_LOW = 0x04,
+
+        // a call made while the same one (method and params) runs
+        // waits for it and gets its result, sync handlers only
+        METHOD_COALESCE = 0x08,
+    };
+
+    // how a pool's workers pick between its priority lanes
+    enum Dispatch
+    {
+        // a lane only runs when those above it are empty
+        DISPATCH_STRICT,
+
+        // lanes share the workers 8:4:1
+        DISPATCH_WEIGHTED,
+    };
+
     struct Method
     {
         std::string name;
         std::string desc;
         Callback cb;
+        int flags;
+        AsyncCallback async_cb;
+
+        // worker pool, "" for the default one
+        std::string pool;
+
+        // millisec results are cached for, < 0 until invalidated,
+        // 0 not cached
+        long cache_ttl;
+
+        // json schemas of params and result, null if not declared
+        nlohmann::json params_schema;
+        nlohmann::json result_schema;
+
+        // params_schema compiled, checked before a request is queued
+        std::shared_ptr<const Schema> params_check;
+
+        // notifications collected into batches of up to batch_max,
+        // or whatever came within batch_window millisec
+        BatchCallback batch_cb;
+        size_t batch_max;
+        long batch_window;
+    };
+
+    struct Metrics
+    {
+        enum
+        {
+            LAG_BUCKETS = 20,
+        };
+
+        // inline handlers run
+        std::atomic<uint64_t> inline_calls { 0 };
+
+        // inline handlers over budget
+        std::atomic<uint64_t> inline_slow { 0 };
+
+        // slowest inline handler seen (microsec)
+        std::atomic<uint64_t> inline_max_us { 0 };
+
+        // deferred requests not completed yet
+        std::atomic<uint64_t> async_pending { 0 };
+
+        // calls of cached methods answered from, or missing in the cache
+        std::atomic<uint64_t> cache_hits { 0 };
+        std::atomic<uint64_t> cache_misses { 0 };
+
+        // requests whose params didn't match the method's schema
+        std::atomic<uint64_t> invalid_params { 0 };
+
+        // notifications taken by batch methods, and batches handed to
+        // the workers
+        std::atomic<uint64_t> batched { 0 };
+        std::atomic<uint64_t> batches { 0 };
+
+        // notifications queued to subscribers by Publish(), and those
+        // skipped because the subscriber wasn't reading its output
+        std::atomic<uint64_t> published { 0 };
+        std::atomic<uint64_t> publish_dropped { 0 };
+
+        // calls that got the result of the same one running already
+        std::atomic<uint64_t> coalesced { 0 };
+
+        // how late the loop ran its 100ms probe, by powers of two:
+        // loop_lag[i] counts lags of [2^i, 2^(i+1)) microsec
+        std::atomic<uint64_t> loop_lag[LAG_BUCKETS] {};
+        std::atomic<uint64_t> loop_lag_max_us { 0 };
+
+        // loop found blocked by the watchdog
+        std::atomic<uint64_t> loop_stalls { 0 };
+
+        // queued requests dropped before they ran, cancelled by the
+        // caller or left behind by a closed connection
+        std::atomic<uint64_t> cancelled { 0 };
+
+        // connections accepted
+        std::atomic<uint64_t> accepted { 0 };
+
+        // accept failures, e.g. out of fds
+        std::atomic<uint64_t> accept_errors { 0 };
+
+        // deepest tcp accept queue seen, sampled every second
+        std::atomic<uint64_t> accept_queue_max { 0 };
+
+        // connections dropped on a full accept queue since
+        // StartListen. the kernel only counts these host wide
+        std::atomic<uint64_t> accept_overflows { 0 };
+
+        // clients paused for not taking their output
+        std::atomic<uint64_t> output_paused { 0 };
+
+        // requests dropped as their deadline passed in the queue
+        std::atomic<uint64_t> expired { 0 };
+    };
+
+    // options of a listening socket and the connections it accepts,
+    // 0 leaves the system default. tcp ones are ignored on unix sockets
+    struct SocketOptions
+    {
+        SocketOptions()
+            : nonblock(true),
+              nodelay(true),
+              sndbuf(0),
+              rcvbuf(0),
+              defer_accept(0),
+              fastopen(0),
+              busy_poll(0),
+              user_timeout(0)
+        {
+        }
+
+        // accepted sockets, only io_uring copes without: StartListen()
+        // fails with EINVAL on other backends
+        bool nonblock;
+
+        // TCP_NODELAY on accepted sockets
+        bool nodelay;
+
+        // SO_SNDBUF, SO_RCVBUF (bytes), accepted sockets inherit them
+        int sndbuf;
+        int rcvbuf;
+
+        // TCP_DEFER_ACCEPT, accept once data arrived (sec)
+        int defer_accept;
+
+        // TCP_FASTOPEN queue length
+        int fastopen;
+
+        // SO_BUSY_POLL on accepted sockets (microsec)
+        int busy_poll;
+
+        // TCP_USER_TIMEOUT on accepted sockets (millisec)
+        int user_timeout;
     };
 
     struct Task
@@ -38,6 +238,20 @@ public:
         int cid;
         nlohmann::json req;
         nlohmann::json resp;
+
+        // not a request, just run this on the worker
+        std::function<void()> fn;
+
+        // steady clock millisec the caller waits until, 0 for ever
+        uint64_t deadline = 0;
+
+        // method and params, of cached or coalesced methods
+        std::string key;
+        uint64_t cache_epoch = 0;
+
+        // traced request, and when it was queued (microsec)
+        uint64_t trace = 0;
+        uint64_t queued = 0;
     };
 
     static JSONRPCServer& Instance()
@@ -48,26 +262,157 @@ public:
 
     bool Ready() const;
 
-    int BindTCP(int port);
-    int BindUnix(const std::string &path);
+    // may be called several times, all listeners are served together
+    int BindTCP(int port,
+                const SocketOptions &opts = SocketOptions());
+
+    // "@name" binds in the abstract namespace
+    int BindUnix(const std::string &path,
+                 const SocketOptions &opts = SocketOptions());
+
+    // listen() backlog, before StartListen. capped by
+    // net.core.somaxconn
+    void SetBacklog(int backlog);
+
+    // connections accepted per wakeup, before StartListen
+    void SetAcceptBatch(int n);
 
-    int StartListen(int worker_num = 4);
+    // requests are queued per connection and handed to the workers
+    // by weighted round robin. fn gives the weight (>= 1) of a newly
+    // accepted socket, e.g. by its peer address. 1 for everyone if unset
+    void SetWeights(std::function<unsigned(int sock)> fn);
+
+    // requests of one connection running on the workers at once,
+    // 0 for no limit
+    void SetMaxInflight(unsigned n);
+
+    // a client whose queued output (bytes) reaches high is not read
+    // from until it drained below low
+    void SetOutputWatermarks(size_t low, size_t high);
+
+    // let unix socket clients switch to shared memory rings ("$/shm")
+    int EnableShm(size_t ring_size = 1 << 20);
+
+    // io_uring falls back to libevent where the kernel lacks it
+    int StartListen(int worker_num = 4,
+                    Reactor::Backend backend = Reactor::LIBEVENT);
+
+    // backend the loop runs on, once started
+    Reactor::Backend Backend() const;
+
+    // the loop itself, NULL before StartListen()
+    Reactor* GetReactor();
 
     void Stop();
 
-    int AddMethod(const std::string &name, Callback cb);
+    int AddMethod(const std::string &name, Callback cb, int flags = 0);
 
+    // pool names one added with AddPool(). a cache_ttl (millisec,
+    // < 0 for no expiry) caches results by params, for methods that
+    // return the same for the same params
     int AddMethod(const std::string &name,
                   const std::string &info,
-                  Callback cb);
+                  Callback cb,
+                  int flags = 0,
+                  const std::string &pool = "",
+                  long cache_ttl = 0);
+
+    // handler replies through a Completion instead of returning
+    int AddAsyncMethod(const std::string &name,
+                       AsyncCallback cb,
+                       int flags = 0);
+
+    int AddAsyncMethod(const std::string &name,
+                       const std::string &info,
+                       AsyncCallback cb,
+                       int flags = 0,
+                       const std::string &pool = "");
+
+    // fire-and-forget ingestion: notifications of name are collected
+    // on the loop and cb gets them on a worker, max at a time or what
+    // came within window millisec (<= 0 waits for max). there's no
+    // reply, requests with an id are refused
+    int AddBatchMethod(const std::string &name,
+                       const std::string &info,
+                       BatchCallback cb,
+                       size_t max = 1024,
+                       long window = 10,
+                       int flags = 0,
+                       const std::string &pool = "");
+
+    // json schemas of a method's params and result, declared along
+    // with AddMethod(). listed by "rpc.discover", and requests whose
+    // params don't match are answered -32602 without reaching a worker.
+    // EINVAL if params isn't a schema Schema understands
+    int SetSchema(const std::string &name,
+                  const nlohmann::json &params,
+                  const nlohmann::json &result = nullptr);
+
+    // workers of their own for the methods put there, before
+    // StartListen. the default pool "" gets StartListen's worker_num
+    int AddPool(const std::string &name,
+                int threads,
+                Dispatch dispatch = DISPATCH_STRICT);
+
+    // for the default pool
+    void SetDispatch(Dispatch dispatch);
+
+    // bytes of cached results kept, 64 MiB by default
+    void SetCacheSize(size_t bytes);
+
+    // forget cached results of method, for all params or for these
+    void InvalidateCache(const std::string &method);
+    void InvalidateCache(const std::string &method,
+                         const nlohmann::json &params);
+
+    // run fn on a worker of the default pool, callable from any thread
+    int Post(std::function<void()> fn);
+
+    // run fn on a worker thread once delay (millisec) expired
+    int PostAfter(long delay, std::function<void()> fn);
+
+    // run fn on a worker thread once fd is readable (true) or
+    // timeout (millisec, < 0 waits forever) expired (false)
+    int PostOnReadable(int fd,
+                       long timeout,
+                       std::function<void(bool)> fn);
+
+    // notify every connection subscribed to topic ("rpc.subscribe"),
+    // the notification's method is the topic. serialized once and
+    // shared by all of them, callable from any thread. -1 with errno
+    // EMSGSIZE if it does not fit in a frame
+    int Publish(const std::string &topic, const nlohmann::json &params);
+
+    // for handlers: millisec until the caller of the request being
+    // served gives up, < 0 if it didn't say
+    static long TimeLeft();
+
+    // for handlers: the caller cancelled the request being served
+    // ("$/cancelRequest"), or is gone. worth checking in long loops
+    static bool Cancelled();
+
+    // trace one request in every sample, 0 stops. with a path,
+    // SIGUSR2 dumps the trace there
+    void SetTracing(unsigned sample, const std::string &path = "");
+
+    // chrome trace event json of the requests traced since the last
+    // dump, see ui.perfetto.dev
+    int DumpTrace(const std::string &path);
+
+    // a watchdog reports the loop when it is blocked longer than this
+    // (millisec), with its stack, on stderr. 0 for none (default),
+    // before StartListen
+    void SetStallThreshold(long ms);
+
+    // inline handlers slower than this are reported (microsec)
+    void SetInlineBudget(uint64_t usec);
+
+    const Metrics& GetMetrics() const;
 
     void RemoveMethod(const std::string &name);
 
     bool HasMethod(const std::string &name);
 
-    // new conn event cb
-    static void OnNewConn(int, short, void*);
-
     // client close cb
     static void OnClientClose(Client*, void*);
 
@@ -77,8 +422,12 @@ private:
 
     int GenUID();
 
-    // AddTask
-    int Push(int cid, const char *data, unsigned int datalen);
+    // AddTask, recv_us is when it was read if tracing. a bad request
+    // is answered with an error, -1 only if the connection can't go on
+    int Push(int cid,
+             const char *data,
+             unsigned int datalen,
+             uint64_t recv_us = 0);
 
     void NewClient(int sock);
 
@@ -91,27 +440,213 @@ private:
     JSONRPCServer();
     virtual ~JSONRPCServer();
 
+    int UpgradeShm(int cid, nlohmann::json &req);
+
+    // "$/cancelRequest": unqueue request id of cid, or flag it if it
+    // is running already
+    void CancelRequest(int cid, const nlohmann::json &id);
+
+    // "rpc.discover": the methods, their descriptions and schemas
+    nlohmann::json Discover();
+
+    // "rpc.subscribe", "rpc.unsubscribe"
+    int Subscribe(int cid, const std::string &topic, bool on);
+
+    // a notification for a batch method
+    void AddToBatch(const Method &m, nlohmann::json &&params);
+
+    // hand what name collected to a worker
+    void FlushBatch(const std::string &name);
+
+    // run fn on the event loop thread
+    void RunInLoop(std::function<void()> fn);
+
+    // write out replies queued by workers, on the loop thread
+    void OnReply();
+
+    // accept queue depth and overflows into the metrics
+    void SampleListeners();
+
+    // dump the trace if SIGUSR2 asked for it
+    void CheckTraceSignal();
+
+    // periodic probe on the loop: lag, heartbeat, trace signal
+    void Tick();
+
+    // watchdog thread, looks for a stuck loop
+    void WatchLoop();
+
+    enum
+    {
+        LANE_HIGH,
+        LANE_NORMAL,
+        LANE_LOW,
+        LANES,
+    };
+
+    // workers and their queues, a flow per client in every lane
+    struct Pool
+    {
+        std::string name;
+        int threads;
+        Dispatch dispatch;
+
+        std::mutex lock;
+        std::condition_variable cond;
+        FairQueue<Task> lanes[LANES];
+
+        // weighted dispatch
+        int credit[LANES];
+
+        std::vector<std::thread> workers;
+    };
+
+    // false if the pool was stopped
+    bool Enqueue(Pool &p, int lane, int flow, Task &&t);
+
+    // lane to take from next, -1 if all are empty
+    int PickLane(Pool &p);
+
+    void WorkerLoop(Pool *p, int ii);
+
+    // a request on a worker, cancel flag of sync handlers
+    struct Running;
+
+    void doInline(const Method &m, Task &&t);
+
     void doTask(Task &&t);
+    void doResult(int cid,
+                  const nlohmann::json &id,
+                  int rc,
+                  const nlohmann::json &resp);
     void doReply(int cid, nlohmann::json &&result);
 
-    int m_socket;
-    struct event_base *m_ev_base;
-    struct event *m_ev[2];
+    // reply around an already serialized result
+    void doReply(int cid,
+                 const nlohmann::json &id,
+                 const std::string &result);
+
+    // frame starts with 2 bytes for its length, from any thread
+    void doSend(int cid, std::string &&frame);
+
+    struct Reply
+    {
+        int cid;
+        std::string frame;
+
+        // traced request and when its reply was handed over
+        uint64_t trace;
+        uint64_t since;
+    };
+
+    struct Listener : public Reactor::Handler
+    {
+        Listener(JSONRPCServer &s,
+                 int fd,
+                 const std::string &p,
+                 const SocketOptions &o)
+            : server(s),
+              sock(fd),
+              path(p),
+              opts(o)
+        {
+        }
+
+        // new conn cb
+        void OnAccept(int conn) override;
+
+        // accept failed
+        void OnError(int err) override;
+
+        JSONRPCServer &server;
+
+        int sock;
+
+        // unix socket path, empty for tcp
+        std::string path;
+
+        SocketOptions opts;
+    };
+
+    std::vector<std::unique_ptr<Listener>> m_listeners;
 
-    bool m_stop;
+    std::atomic<bool> m_stop;
 
     uint32_t m_counter;
 
+    size_t m_shm_ring_size;
+
+    uint64_t m_inline_budget_us;
+
+    int m_backlog;
+    int m_accept_batch;
+
+    // host wide overflow count at StartListen, < 0 if unknown
+    int64_t m_overflow_base;
+
+    size_t m_output_low;
+    size_t m_output_high;
+
+    std::function<unsigned(int)> m_weight_fn;
+    unsigned m_max_inflight;
+
+    Metrics m_metrics;
+
+    ResultCache m_cache;
+
+    Tracer m_tracer;
+    std::string m_trace_path;
+
+    // when Tick() last ran (microsec), the loop thread's
+    uint64_t m_last_tick;
+
+    // the same in millisec, for the watchdog
+    std::atomic<uint64_t> m_heartbeat;
+
+    long m_stall_ms;
+    pthread_t m_loop_thread;
+    std::thread m_watchdog;
+
+    // event loop, clients go before it
+    std::unique_ptr<Reactor> m_reactor;
+
+    // replies waiting for the event loop
+    std::mutex m_reply_lock;
+    std::vector<Reply> m_replies;
+
+    // deferred requests by client
+    std::mutex m_pending_lock;
+    std::map<int, std::set<Completion::State*>> m_pending;
+
+    // requests in sync handlers by client, under m_pending_lock too
+    std::map<int, std::set<Running*>> m_running;
+
+    // coalesced calls running, and the cid and id of those waiting
+    // for their result
+    std::mutex m_flight_lock;
+    std::unordered_map<std::string,
+                       std::vector<std::pair<int, nlohmann::json>>> m_flights;
+
     // rpc clients
     std::map<int, std::unique_ptr<Client>> m_clients;
 
-    // worker
-    std::vector<std::thread> m_workers;
+    // subscribers by topic, loop thread only
+    std::unordered_map<std::string, std::set<int>> m_topics;
+
+    // notifications collected by batch method, loop thread only
+    struct Batch
+    {
+        std::vector<nlohmann::json> params;
+
+        // window timer, 0 if none
+        Reactor::TimerId timer;
+    };
+
+    std::map<std::string, Batch> m_batches;
 
-    // task queue
-    std::mutex m_task_lock;
-    std::condition_variable m_task_cond;
-    std::queue<Task> m_tasks;
+    // worker pools by name. Post() jobs share flow 0 of the default
+    // pool's normal lane
+    std::map<std::string, std::unique_ptr<Pool>> m_pools;
 
     //RPC methods
     std::map<std::string, Method> m_methods;
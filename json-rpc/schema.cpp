@@ -0,0 +1,428 @@
+#include <errno.h>
+#include <math.h>
+
+#include <limits>
+#include <memory>
+#include <new>
+
+#include "schema.h"
+
+OOLONG_NS_BEGIN
+
+static const struct
+{
+    const char *name;
+    unsigned type;
+} s_types[] =
+{
+    { "null", 0x01 },
+    { "boolean", 0x02 },
+    { "integer", 0x04 },
+    { "number", 0x08 },
+    { "string", 0x10 },
+    { "array", 0x20 },
+    { "object", 0x40 },
+};
+
+static unsigned TypeOf(const std::string &name)
+{
+    for (auto &t : s_types)
+    {
+        if (name == t.name)
+            return t.type;
+    }
+
+    return 0;
+}
+
+// "string or null"
+static std::string NamesOf(unsigned types)
+{
+    std::string names;
+
+    for (auto &t : s_types)
+    {
+        if (!(types & t.type))
+            continue;
+
+        if (!names.empty())
+            names += " or ";
+
+        names += t.name;
+    }
+
+    return names;
+}
+
+// a size limit, -1 if it isn't one
+static long Limit(const nlohmann::json &s, const char *key)
+{
+    auto it = s.find(key);
+
+    if (it == s.end())
+        return 0;
+
+    if (!it->is_number_integer() ||
+        it->get<long>() < 0)
+    {
+        return -1;
+    }
+
+    return it->get<long>();
+}
+
+Schema::Node::Node()
+    : never(false),
+      types(0),
+      closed(false),
+      items(-1),
+      has_minimum(false),
+      has_maximum(false),
+      minimum(0),
+      maximum(0),
+      min_length(0),
+      max_length(std::numeric_limits<size_t>::max())
+{
+}
+
+Schema* Schema::Compile(const nlohmann::json &s)
+{
+    std::unique_ptr<Schema> schema(new (std::nothrow) Schema());
+
+    if (!schema)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (schema->Build(s) < 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return schema.release();
+}
+
+int Schema::Build(const nlohmann::json &s)
+{
+    // true (or {}) takes anything, false nothing
+    if (s.is_boolean())
+    {
+        m_nodes.emplace_back();
+        m_nodes.back().never = !s.get<bool>();
+        return m_nodes.size() - 1;
+    }
+
+    if (!s.is_object())
+        return -1;
+
+    int id = m_nodes.size();
+    m_nodes.emplace_back();
+
+    // children are appended below, no references into m_nodes meanwhile
+    Node n;
+
+    auto type = s.find("type");
+
+    if (type != s.end())
+    {
+        auto names = type->is_array() ? *type : nlohmann::json::array({ *type });
+
+        for (auto &name : names)
+        {
+            unsigned t = name.is_string() ? TypeOf(name) : 0;
+
+            if (!t)
+                return -1;
+
+            n.types |= t;
+        }
+    }
+
+    auto e = s.find("enum");
+
+    if (e != s.end())
+    {
+        if (!e->is_array())
+            return -1;
+
+        n.enums.assign(e->begin(), e->end());
+    }
+
+    auto props = s.find("properties");
+
+    if (props != s.end())
+    {
+        if (!props->is_object())
+            return -1;
+
+        for (auto it = props->begin(); it != props->end(); ++it)
+        {
+            int child = Build(it.value());
+
+            if (child < 0)
+                return -1;
+
+            n.properties.emplace_back(it.key(), child);
+        }
+    }
+
+    auto req = s.find("required");
+
+    if (req != s.end())
+    {
+        if (!req->is_array())
+            return -1;
+
+        for (auto &name : *req)
+        {
+            if (!name.is_string())
+                return -1;
+
+            n.required.push_back(name);
+        }
+    }
+
+    auto extra = s.find("additionalProperties");
+
+    if (extra != s.end() &&
+        extra->is_boolean())
+    {
+        n.closed = !extra->get<bool>();
+    }
+
+    auto items = s.find("items");
+
+    if (items != s.end())
+    {
+        n.items = Build(*items);
+
+        if (n.items < 0)
+            return -1;
+    }
+
+    auto min = s.find("minimum");
+
+    if (min != s.end())
+    {
+        if (!min->is_number())
+            return -1;
+
+        n.has_minimum = true;
+        n.minimum = min->get<double>();
+    }
+
+    auto max = s.find("maximum");
+
+    if (max != s.end())
+    {
+        if (!max->is_number())
+            return -1;
+
+        n.has_maximum = true;
+        n.maximum = max->get<double>();
+    }
+
+    // strings and arrays have but one length
+    const char *keys[][2] =
+    {
+        { "minLength", "maxLength" },
+        { "minItems", "maxItems" },
+    };
+
+    for (auto &k : keys)
+    {
+        long lo = Limit(s, k[0]);
+        long hi = Limit(s, k[1]);
+
+        if (lo < 0 || hi < 0)
+            return -1;
+
+        if (lo)
+            n.min_length = lo;
+
+        if (s.count(k[1]))
+            n.max_length = hi;
+    }
+
+    m_nodes[id] = std::move(n);
+    return id;
+}
+
+bool Schema::Validate(const nlohmann::json &v, std::string *err) const
+{
+    std::string e;
+
+    if (Check(0, v, &e))
+        return true;
+
+    if (err)
+        err->swap(e);
+
+    return false;
+}
+
+bool Schema::Check(int node, const nlohmann::json &v, std::string *err) const
+{
+    auto &n = m_nodes[node];
+
+    if (n.never)
+    {
+        *err = ": not allowed";
+        return false;
+    }
+
+    if (n.types)
+    {
+        unsigned t = 0;
+
+        switch (v.type())
+        {
+        case nlohmann::json::value_t::null:
+            t = TYPE_NULL;
+            break;
+        case nlohmann::json::value_t::boolean:
+            t = TYPE_BOOLEAN;
+            break;
+        case nlohmann::json::value_t::number_integer:
+        case nlohmann::json::value_t::number_unsigned:
+            t = TYPE_INTEGER | TYPE_NUMBER;
+            break;
+        case nlohmann::json::value_t::number_float:
+        {
+            double d = v.get<double>();
+
+            // 1.0 is an integer too
+            t = (d == floor(d)) ? (TYPE_INTEGER | TYPE_NUMBER) : TYPE_NUMBER;
+            break;
+        }
+        case nlohmann::json::value_t::string:
+            t = TYPE_STRING;
+            break;
+        case nlohmann::json::value_t::array:
+            t = TYPE_ARRAY;
+            break;
+        case nlohmann::json::value_t::object:
+            t = TYPE_OBJECT;
+            break;
+        default:
+            break;
+        }
+
+        if (!(t & n.types))
+        {
+            *err = ": not " + NamesOf(n.types);
+            return false;
+        }
+    }
+
+    if (!n.enums.empty())
+    {
+        bool found = false;
+
+        for (auto &e : n.enums)
+        {
+            if (e == v)
+            {
+                found = true;
+                break;
+            }
+        }
+
+        if (!found)
+        {
+            *err = ": not one of the allowed values";
+            return false;
+        }
+    }
+
+    if (v.is_number())
+    {
+        double d = v.get<double>();
+
+        if ((n.has_minimum && d < n.minimum) ||
+            (n.has_maximum && d > n.maximum))
+        {
+            *err = ": out of range";
+            return false;
+        }
+    }
+    else if (v.is_string() || v.is_array())
+    {
+        size_t len = v.is_string() ?
+                     v.get_ref<const std::string&>().size() : v.size();
+
+        if (len < n.min_length ||
+            len > n.max_length)
+        {
+            *err = v.is_string() ? ": bad length" : ": bad number of items";
+            return false;
+        }
+
+        if (v.is_array() &&
+            n.items >= 0)
+        {
+            for (size_t i = 0; i < v.size(); ++i)
+            {
+                if (!Check(n.items, v[i], err))
+                {
+                    err->insert(0, "/" + std::to_string(i));
+                    return false;
+                }
+            }
+        }
+    }
+    else if (v.is_object())
+    {
+        for (auto &name : n.required)
+        {
+            if (!v.count(name))
+            {
+                *err = "/" + name + ": missing";
+                return false;
+            }
+        }
+
+        for (auto &p : n.properties)
+        {
+            auto it = v.find(p.first);
+
+            if (it == v.end())
+                continue;
+
+            if (!Check(p.second, *it, err))
+            {
+                err->insert(0, "/" + p.first);
+                return false;
+            }
+        }
+
+        if (n.closed)
+        {
+            for (auto it = v.begin(); it != v.end(); ++it)
+            {
+                bool known = false;
+
+                for (auto &p : n.properties)
+                {
+                    if (p.first == it.key())
+                    {
+                        known = true;
+                        break;
+                    }
+                }
+
+                if (!known)
+                {
+                    *err = "/" + it.key() + ": not allowed";
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+OOLONG_NS_END
@@ -0,0 +1,84 @@
+#ifndef OOLONG_SCHEMA_H
+#define OOLONG_SCHEMA_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "oolong.h"
+#include "json.hpp"
+
+OOLONG_NS_BEGIN
+
+// a json schema compiled into flat checks, so validating walks an array
+// instead of looking keywords up. understands type, enum, properties,
+// required, additionalProperties (true/false), items, minimum, maximum,
+// minLength, maxLength, minItems and maxItems, and the boolean schemas
+// true and false. other keywords are ignored, as json schema has it
+class Schema
+{
+public:
+    // NULL, errno EINVAL if s is malformed
+    static Schema* Compile(const nlohmann::json &s);
+
+    // false with what failed where in *err, e.g. "/ms: not an integer"
+    bool Validate(const nlohmann::json &v, std::string *err) const;
+
+private:
+    enum
+    {
+        TYPE_NULL = 0x01,
+        TYPE_BOOLEAN = 0x02,
+        TYPE_INTEGER = 0x04,
+        TYPE_NUMBER = 0x08,
+        TYPE_STRING = 0x10,
+        TYPE_ARRAY = 0x20,
+        TYPE_OBJECT = 0x40,
+    };
+
+    struct Node
+    {
+        Node();
+
+        // the false schema, nothing matches
+        bool never;
+
+        // allowed types, 0 for any
+        unsigned types;
+
+        std::vector<nlohmann::json> enums;
+
+        // name and node of each property
+        std::vector<std::pair<std::string, int>> properties;
+        std::vector<std::string> required;
+
+        // additionalProperties: false
+        bool closed;
+
+        // node array elements must match, -1 for any
+        int items;
+
+        bool has_minimum;
+        bool has_maximum;
+        double minimum;
+        double maximum;
+
+        // of strings, arrays
+        size_t min_length;
+        size_t max_length;
+    };
+
+    Schema() {}
+
+    // node of s, -1 if malformed
+    int Build(const nlohmann::json &s);
+
+    bool Check(int node, const nlohmann::json &v, std::string *err) const;
+
+    // node 0 is the root
+    std::vector<Node> m_nodes;
+};
+
+OOLONG_NS_END
+
+#endif
@@ -0,0 +1,497 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <algorithm>
+
+#include "shm_channel.h"
+
+OOLONG_NS_BEGIN
+
+// keeps ring data page aligned
+static const size_t kHeaderSize = 4096;
+
+ShmRing::ShmRing()
+    : m_hdr(NULL),
+      m_data(NULL),
+      m_size(0)
+{
+}
+
+void ShmRing::Attach(void *mem, size_t size, bool init)
+{
+    m_hdr = static_cast<ShmRingHeader*>(mem);
+    m_data = static_cast<char*>(mem) + kHeaderSize;
+    m_size = size;
+
+    if (init)
+    {
+        new (m_hdr) ShmRingHeader();
+
+        m_hdr->head.store(0);
+        m_hdr->tail.store(0);
+        m_hdr->reader_waiting.store(0);
+        m_hdr->writer_waiting.store(0);
+    }
+}
+
+ShmRingHeader* ShmRing::Header()
+{
+    return m_hdr;
+}
+
+size_t ShmRing::Readable() const
+{
+    uint64_t head = m_hdr->head.load(std::memory_order_relaxed);
+    uint64_t tail = m_hdr->tail.load(std::memory_order_acquire);
+
+    return std::min((size_t) (tail - head), m_size);
+}
+
+size_t ShmRing::Writable() const
+{
+    uint64_t head = m_hdr->head.load(std::memory_order_acquire);
+    uint64_t tail = m_hdr->tail.load(std::memory_order_relaxed);
+
+    return m_size - std::min((size_t) (tail - head), m_size);
+}
+
+bool ShmRing::Corrupted() const
+{
+    uint64_t head = m_hdr->head.load(std::memory_order_acquire);
+    uint64_t tail = m_hdr->tail.load(std::memory_order_acquire);
+
+    return ((tail - head) > m_size);
+}
+
+size_t ShmRing::Write(const char *data, size_t datalen)
+{
+    size_t n = std::min(datalen, Writable());
+
+    if (!n)
+        return 0;
+
+    uint64_t tail = m_hdr->tail.load(std::memory_order_relaxed);
+    size_t pos = tail & (m_size - 1);
+    size_t first = std::min(n, m_size - pos);
+
+    memcpy(m_data + pos, data, first);
+    memcpy(m_data, data + first, n - first);
+
+    m_hdr->tail.store(tail + n, std::memory_order_release);
+    return n;
+}
+
+size_t ShmRing::Read(char *data, size_t datalen)
+{
+    size_t n = std::min(datalen, Readable());
+
+    if (!n)
+        return 0;
+
+    uint64_t head = m_hdr->head.load(std::memory_order_relaxed);
+    size_t pos = head & (m_size - 1);
+    size_t first = std::min(n, m_size - pos);
+
+    memcpy(data, m_data + pos, first);
+    memcpy(data + first, m_data, n - first);
+
+    m_hdr->head.store(head + n, std::memory_order_release);
+    return n;
+}
+
+ShmChannel::ShmChannel(Role role)
+    : m_role(role),
+      m_fds { -1, -1, -1 },
+      m_mem(NULL),
+      m_mem_size(0),
+      m_ring_size(0)
+{
+}
+
+ShmChannel::~ShmChannel()
+{
+    Reset();
+}
+
+void ShmChannel::Reset()
+{
+    if (m_mem)
+    {
+        munmap(m_mem, m_mem_size);
+        m_mem = NULL;
+    }
+
+    for (auto &fd : m_fds)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    m_mem_size = 0;
+    m_ring_size = 0;
+}
+
+size_t ShmChannel::RingSize() const
+{
+    return m_ring_size;
+}
+
+int ShmChannel::Create(size_t ring_size)
+{
+    Reset();
+
+    size_t size = 4096;
+
+    while (size < ring_size)
+        size <<= 1;
+
+    do
+    {
+        m_fds[FD_MEM] = memfd_create("oolong-shm",
+                                      MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+        if (m_fds[FD_MEM] < 0)
+            break;
+
+        m_fds[FD_SERVER_BELL] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        m_fds[FD_CLIENT_BELL] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (m_fds[FD_SERVER_BELL] < 0 ||
+            m_fds[FD_CLIENT_BELL] < 0)
+        {
+            break;
+        }
+
+        m_mem_size = 2 * (kHeaderSize + size);
+
+        if (ftruncate(m_fds[FD_MEM], m_mem_size) < 0)
+            break;
+
+        // the client must not be able to cut the rings under us
+        if (fcntl(m_fds[FD_MEM],
+                  F_ADD_SEALS,
+                  F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+        {
+            break;
+        }
+
+        m_mem = mmap(NULL,
+                     m_mem_size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED,
+                     m_fds[FD_MEM],
+                     0);
+
+        if (m_mem == MAP_FAILED)
+        {
+            m_mem = NULL;
+            break;
+        }
+
+        m_ring_size = size;
+
+        char *c2s = static_cast<char*>(m_mem);
+        char *s2c = c2s + kHeaderSize + size;
+
+        m_rx.Attach(c2s, size, true);
+        m_tx.Attach(s2c, size, true);
+
+        // the event loop always waits on its doorbell
+        m_rx.Header()->reader_waiting.store(1);
+
+        return 0;
+
+    } while (0);
+
+    int err = errno;
+    Reset();
+    errno = err;
+    return -1;
+}
+
+int ShmChannel::Attach(const int fds[FD_NUM], size_t ring_size)
+{
+    Reset();
+
+    for (int i = 0; i < FD_NUM; ++i)
+        m_fds[i] = fds[i];
+
+    do
+    {
+        if (ring_size < 4096 ||
+            (ring_size & (ring_size - 1)))
+        {
+            errno = EINVAL;
+            break;
+        }
+
+        if (m_fds[FD_MEM] < 0 ||
+            m_fds[FD_SERVER_BELL] < 0 ||
+            m_fds[FD_CLIENT_BELL] < 0)
+        {
+            errno = EBADF;
+            break;
+        }
+
+        m_mem_size = 2 * (kHeaderSize + ring_size);
+
+        // an unsealed or short memfd could fault us on any access
+        const int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+        int got = fcntl(m_fds[FD_MEM], F_GET_SEALS);
+        struct stat st;
+
+        if (got < 0)
+            break;
+
+        if ((got & seals) != seals)
+        {
+            errno = EPERM;
+            break;
+        }
+
+        if (fstat(m_fds[FD_MEM], &st) < 0)
+            break;
+
+        if ((size_t) st.st_size < m_mem_size)
+        {
+            errno = EINVAL;
+            break;
+        }
+
+        m_mem = mmap(NULL,
+                     m_mem_size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED,
+                     m_fds[FD_MEM],
+                     0);
+
+        if (m_mem == MAP_FAILED)
+        {
+            m_mem = NULL;
+            break;
+        }
+
+        m_ring_size = ring_size;
+
+        char *c2s = static_cast<char*>(m_mem);
+        char *s2c = c2s + kHeaderSize + ring_size;
+
+        m_tx.Attach(c2s, ring_size, false);
+        m_rx.Attach(s2c, ring_size, false);
+
+        return 0;
+
+    } while (0);
+
+    int err = errno;
+    Reset();
+    errno = err;
+    return -1;
+}
+
+int ShmChannel::SendFds(int sock, const char *data, size_t datalen)
+{
+    struct msghdr msg;
+    struct iovec iov;
+
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int) * FD_NUM)];
+        struct cmsghdr align;
+    } ctl;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctl, 0, sizeof(ctl));
+
+    iov.iov_base = const_cast<char*>(data);
+    iov.iov_len = datalen;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * FD_NUM);
+
+    memcpy(CMSG_DATA(cmsg), m_fds, sizeof(int) * FD_NUM);
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+int ShmChannel::RecvFds(int sock, char *data, size_t datalen, int fds[FD_NUM])
+{
+    struct msghdr msg;
+    struct iovec iov;
+
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int) * FD_NUM)];
+        struct cmsghdr align;
+    } ctl;
+
+    for (int i = 0; i < FD_NUM; ++i)
+        fds[i] = -1;
+
+    memset(&msg, 0, sizeof(msg));
+
+    iov.iov_base = data;
+    iov.iov_len = datalen;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    int rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+
+    if (rc <= 0)
+        return rc;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+         cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+
+        size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        memcpy(fds, CMSG_DATA(cmsg), std::min(n, (size_t) FD_NUM) * sizeof(int));
+
+        // more than we asked for
+        for (size_t i = FD_NUM; i < n; ++i)
+        {
+            int extra;
+            memcpy(&extra, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            close(extra);
+        }
+    }
+
+    return rc;
+}
+
+size_t ShmChannel::Write(const char *data, size_t datalen)
+{
+    size_t n = m_tx.Write(data, datalen);
+
+    if (!n)
+        return 0;
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (m_tx.Header()->reader_waiting.load(std::memory_order_relaxed))
+    {
+        Notify();
+    }
+
+    return n;
+}
+
+size_t ShmChannel::Read(char *data, size_t datalen)
+{
+    size_t n = m_rx.Read(data, datalen);
+
+    if (!n)
+        return 0;
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (m_rx.Header()->writer_waiting.exchange(0))
+    {
+        Notify();
+    }
+
+    return n;
+}
+
+size_t ShmChannel::Readable() const
+{
+    return m_rx.Readable();
+}
+
+size_t ShmChannel::Writable() const
+{
+    return m_tx.Writable();
+}
+
+bool ShmChannel::Corrupted() const
+{
+    return (m_rx.Corrupted() || m_tx.Corrupted());
+}
+
+bool ShmChannel::PrepareWait()
+{
+    m_rx.Header()->reader_waiting.store(1, std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (m_rx.Readable())
+    {
+        FinishWait();
+        return false;
+    }
+
+    return true;
+}
+
+void ShmChannel::FinishWait()
+{
+    m_rx.Header()->reader_waiting.store(0, std::memory_order_relaxed);
+}
+
+bool ShmChannel::PrepareWaitSpace()
+{
+    m_tx.Header()->writer_waiting.store(1, std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    return (m_tx.Writable() == 0);
+}
+
+int ShmChannel::Doorbell() const
+{
+    return (m_role == SERVER) ?
+        m_fds[FD_SERVER_BELL] :
+        m_fds[FD_CLIENT_BELL];
+}
+
+void ShmChannel::Drain()
+{
+    uint64_t n;
+
+    while (read(Doorbell(), &n, sizeof(n)) > 0)
+        ;
+}
+
+void ShmChannel::Notify()
+{
+    uint64_t n = 1;
+
+    int fd = (m_role == SERVER) ?
+        m_fds[FD_CLIENT_BELL] :
+        m_fds[FD_SERVER_BELL];
+
+    if (write(fd, &n, sizeof(n)) < 0)
+    {
+        // counter saturated, peer is awake anyway
+    }
+}
+
+OOLONG_NS_END
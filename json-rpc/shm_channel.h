@@ -0,0 +1,146 @@
+#ifndef OOLONG_SHM_CHANNEL_H
+#define OOLONG_SHM_CHANNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+#include "oolong.h"
+
+OOLONG_NS_BEGIN
+
+// control block of a ring, shared between processes
+struct ShmRingHeader
+{
+    // consumer position
+    alignas(64) std::atomic<uint64_t> head;
+
+    // producer position
+    alignas(64) std::atomic<uint64_t> tail;
+
+    // consumer sleeps on its doorbell
+    alignas(64) std::atomic<uint32_t> reader_waiting;
+
+    // producer ran out of space
+    std::atomic<uint32_t> writer_waiting;
+};
+
+// single producer single consumer byte ring
+class ShmRing
+{
+public:
+    ShmRing();
+
+    void Attach(void *mem, size_t size, bool init);
+
+    // bytes copied in, may be less than datalen
+    size_t Write(const char *data, size_t datalen);
+
+    // bytes copied out, may be less than datalen
+    size_t Read(char *data, size_t datalen);
+
+    size_t Readable() const;
+
+    size_t Writable() const;
+
+    // positions written by the peer are not trusted
+    bool Corrupted() const;
+
+    ShmRingHeader* Header();
+
+private:
+    ShmRingHeader *m_hdr;
+    char *m_data;
+    size_t m_size;
+};
+
+// a pair of rings in a memfd, with eventfd doorbells for each side.
+// the server creates the channel and hands the fds to the client over
+// a unix socket.
+class ShmChannel
+{
+public:
+    enum Role
+    {
+        SERVER,
+        CLIENT,
+    };
+
+    enum
+    {
+        FD_MEM,
+        FD_SERVER_BELL,
+        FD_CLIENT_BELL,
+        FD_NUM,
+    };
+
+    ShmChannel(Role role);
+    virtual ~ShmChannel();
+
+    // server side, ring_size is rounded up to a power of two. the
+    // memfd is sealed against resizing
+    int Create(size_t ring_size);
+
+    // client side, takes ownership of fds. fails with EPERM if the
+    // memfd is not sealed
+    int Attach(const int fds[FD_NUM], size_t ring_size);
+
+    size_t RingSize() const;
+
+    // send data along with the channel fds
+    int SendFds(int sock, const char *data, size_t datalen);
+
+    // receive data and up to FD_NUM fds (missing ones are -1)
+    static int RecvFds(int sock, char *data, size_t datalen, int fds[FD_NUM]);
+
+    // to peer, rings the peer's doorbell when it is waiting
+    size_t Write(const char *data, size_t datalen);
+
+    // from peer, rings the peer's doorbell when it waits for space
+    size_t Read(char *data, size_t datalen);
+
+    size_t Readable() const;
+
+    size_t Writable() const;
+
+    bool Corrupted() const;
+
+    // announce we're about to sleep on our doorbell, false if data
+    // arrived meanwhile
+    bool PrepareWait();
+
+    // we're awake again
+    void FinishWait();
+
+    // announce we're about to sleep for space, false if space freed
+    bool PrepareWaitSpace();
+
+    // fd that becomes readable when the peer rings us
+    int Doorbell() const;
+
+    // reset our doorbell
+    void Drain();
+
+    // ring the peer
+    void Notify();
+
+private:
+    void Reset();
+
+    Role m_role;
+    int m_fds[FD_NUM];
+
+    void *m_mem;
+    size_t m_mem_size;
+    size_t m_ring_size;
+
+    // server: client->server, client: server->client
+    ShmRing m_rx;
+
+    // server: server->client, client: client->server
+    ShmRing m_tx;
+};
+
+OOLONG_NS_END
+
+#endif
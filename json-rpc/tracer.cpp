@@ -0,0 +1,158 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+
+#include <chrono>
+#include <algorithm>
+#include <new>
+
+#include "tracer.h"
+
+OOLONG_NS_BEGIN
+
+Tracer::Tracer()
+    : m_every(0),
+      m_seq(0),
+      m_dropped(0)
+{
+}
+
+void Tracer::SetSampling(unsigned n)
+{
+    m_every = n;
+}
+
+bool Tracer::Enabled() const
+{
+    return (m_every.load(std::memory_order_relaxed) != 0);
+}
+
+uint64_t Tracer::Sample()
+{
+    unsigned every = m_every.load(std::memory_order_relaxed);
+
+    if (!every)
+        return 0;
+
+    uint64_t n = m_seq.fetch_add(1, std::memory_order_relaxed) + 1;
+
+    return (n % every) ? 0 : n;
+}
+
+uint64_t Tracer::Now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Tracer::Buffer* Tracer::Local()
+{
+    // a thread may record for more than one tracer
+    static thread_local std::vector<std::pair<Tracer*, Buffer*>> t_local;
+
+    for (auto &it : t_local)
+    {
+        if (it.first == this)
+            return it.second;
+    }
+
+    std::shared_ptr<Buffer> b(new (std::nothrow) Buffer());
+
+    if (!b)
+        return NULL;
+
+    b->tid = syscall(SYS_gettid);
+
+    {
+        std::unique_lock<std::mutex>
+            lock(m_lock);
+
+        m_buffers.push_back(b);
+    }
+
+    // the tracer holds on to it, it outlives the thread
+    t_local.emplace_back(this, b.get());
+    return b.get();
+}
+
+void Tracer::Record(uint64_t id,
+                    const char *stage,
+                    uint64_t begin,
+                    uint64_t end)
+{
+    auto *b = Local();
+
+    if (!b)
+        return;
+
+    std::unique_lock<std::mutex>
+        lock(b->lock);
+
+    if (b->events.size() >= BUFFER_EVENTS)
+    {
+        ++m_dropped;
+        return;
+    }
+
+    b->events.push_back(Event { id, stage, begin, end });
+}
+
+std::string Tracer::Dump()
+{
+    std::vector<std::shared_ptr<Buffer>> buffers;
+
+    {
+        std::unique_lock<std::mutex>
+            lock(m_lock);
+
+        buffers = m_buffers;
+    }
+
+    int pid = getpid();
+
+    std::string s = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+
+    char line[256];
+
+    for (auto &b : buffers)
+    {
+        std::vector<Event> events;
+
+        {
+            std::unique_lock<std::mutex>
+                lock(b->lock);
+
+            events.swap(b->events);
+        }
+
+        // async slices, grouped into a track per request id
+        for (auto &e : events)
+        {
+            snprintf(line, sizeof(line),
+                     "%s"
+                     "{\"cat\":\"rpc\",\"name\":\"%s\",\"ph\":\"b\","
+                     "\"id\":%lu,\"pid\":%d,\"tid\":%d,\"ts\":%lu},"
+                     "{\"cat\":\"rpc\",\"name\":\"%s\",\"ph\":\"e\","
+                     "\"id\":%lu,\"pid\":%d,\"tid\":%d,\"ts\":%lu}",
+                     first ? "" : ",",
+                     e.stage, (unsigned long) e.id, pid, b->tid,
+                     (unsigned long) e.begin,
+                     e.stage, (unsigned long) e.id, pid, b->tid,
+                     (unsigned long) std::max(e.end, e.begin));
+
+            s += line;
+            first = false;
+        }
+    }
+
+    s += "]}";
+    return s;
+}
+
+uint64_t Tracer::Dropped() const
+{
+    return m_dropped;
+}
+
+OOLONG_NS_END
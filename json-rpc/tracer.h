@@ -0,0 +1,81 @@
+#ifndef OOLONG_TRACER_H
+#define OOLONG_TRACER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+#include "oolong.h"
+
+OOLONG_NS_BEGIN
+
+// per request timings of a sample of requests, each thread records into
+// a buffer of its own. dumped as chrome trace events (chrome://tracing,
+// ui.perfetto.dev), one track per request with a slice per stage
+class Tracer
+{
+public:
+    Tracer();
+
+    // trace one request in every n, 0 stops
+    void SetSampling(unsigned n);
+
+    bool Enabled() const;
+
+    // id for a new request, 0 if it is not traced
+    uint64_t Sample();
+
+    // steady clock microsec
+    static uint64_t Now();
+
+    // request id spent begin to end in stage, a string literal
+    void Record(uint64_t id, const char *stage, uint64_t begin, uint64_t end);
+
+    // trace event json of the events recorded since the last Dump()
+    std::string Dump();
+
+    // events lost to full buffers
+    uint64_t Dropped() const;
+
+private:
+    enum
+    {
+        // events a thread keeps between dumps
+        BUFFER_EVENTS = 64 * 1024,
+    };
+
+    struct Event
+    {
+        uint64_t id;
+        const char *stage;
+        uint64_t begin;
+        uint64_t end;
+    };
+
+    struct Buffer
+    {
+        // only contended by Dump()
+        std::mutex lock;
+        std::vector<Event> events;
+
+        int tid;
+    };
+
+    // the calling thread's, registered on first use
+    Buffer* Local();
+
+    std::atomic<unsigned> m_every;
+    std::atomic<uint64_t> m_seq;
+    std::atomic<uint64_t> m_dropped;
+
+    std::mutex m_lock;
+    std::vector<std::shared_ptr<Buffer>> m_buffers;
+};
+
+OOLONG_NS_END
+
+#endif
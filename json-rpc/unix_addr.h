@@ -0,0 +1,51 @@
+#ifndef OOLONG_UNIX_ADDR_H
+#define OOLONG_UNIX_ADDR_H
+
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "oolong.h"
+
+OOLONG_NS_BEGIN
+
+// a leading '@' selects the linux abstract namespace
+inline bool IsAbstractUnixPath(const std::string &path)
+{
+    return (!path.empty() && path[0] == '@');
+}
+
+inline int MakeUnixAddr(const std::string &path,
+                        struct sockaddr_un *addr,
+                        socklen_t *addrlen)
+{
+    if (path.empty() ||
+        path.size() >= sizeof(addr->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    memcpy(addr->sun_path, path.data(), path.size());
+
+    if (IsAbstractUnixPath(path))
+    {
+        addr->sun_path[0] = '\0';
+
+        *addrlen = offsetof(struct sockaddr_un, sun_path) + path.size();
+        return 0;
+    }
+
+    *addrlen = sizeof(*addr);
+    return 0;
+}
+
+OOLONG_NS_END
+
+#endif
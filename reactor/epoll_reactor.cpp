@@ -0,0 +1,235 @@
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+#include "epoll_reactor.h"
+
+OOLONG_NS_BEGIN
+
+EpollReactor::EpollReactor()
+    : m_epfd(-1)
+{
+}
+
+EpollReactor::~EpollReactor()
+{
+    Clear();
+
+    if (m_epfd >= 0)
+        close(m_epfd);
+}
+
+Reactor::Backend EpollReactor::Type() const
+{
+    return EPOLL;
+}
+
+int EpollReactor::Init()
+{
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (m_epfd < 0)
+        return -1;
+
+    return AddWatch(m_wake_fd, &m_waker);
+}
+
+int EpollReactor::Add(int fd, Kind kind, Handler *h)
+{
+    if (fd < 0 || !h)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // edges are only used up by EAGAIN
+    if (kind != WATCH)
+    {
+        int flags = fcntl(fd, F_GETFL);
+
+        if (flags < 0 ||
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        {
+            return -1;
+        }
+    }
+
+    auto *e = new (std::nothrow) EpollEntry(fd, kind, h);
+
+    if (Insert(e) < 0)
+        return -1;
+
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = e;
+
+    if (kind == STREAM)
+        ev.events |= EPOLLOUT | EPOLLRDHUP;
+
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        int err = errno;
+        Retire(Take(fd));
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+int EpollReactor::AddListener(int fd, Handler *h)
+{
+    return Add(fd, LISTENER, h);
+}
+
+int EpollReactor::AddStream(int fd, Handler *h)
+{
+    return Add(fd, STREAM, h);
+}
+
+int EpollReactor::AddWatch(int fd, Handler *h)
+{
+    return Add(fd, WATCH, h);
+}
+
+int EpollReactor::Remove(int fd)
+{
+    auto e = Take(fd);
+
+    if (!e)
+        return -1;
+
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, NULL);
+
+    // events of this round may still point at it
+    Retire(std::move(e));
+    return 0;
+}
+
+int EpollReactor::EnableRead(int fd, bool on)
+{
+    auto *e = static_cast<EpollEntry*>(Find(fd));
+
+    if (!e)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (e->paused && on)
+    {
+        // the edge may have passed meanwhile
+        e->resume = true;
+        m_pending.push_back(fd);
+    }
+
+    e->paused = !on;
+    return 0;
+}
+
+int EpollReactor::WantWrite(int fd)
+{
+    auto *e = static_cast<EpollEntry*>(Find(fd));
+
+    if (!e || e->kind != STREAM)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (!e->want_write)
+    {
+        e->want_write = true;
+        m_pending.push_back(fd);
+    }
+
+    return 0;
+}
+
+void EpollReactor::ReadAll(EpollEntry *e, bool hup)
+{
+    while (!e->dead &&
+           !e->paused)
+    {
+        int rc = ReadReady(e);
+
+        // accept batch used up, the rest after this round's events
+        if (e->kind == LISTENER &&
+            rc == READ_MORE)
+        {
+            e->resume = true;
+            m_pending.push_back(e->fd);
+            break;
+        }
+
+        // after a hangup read on until eof shows up
+        if (rc == READ_MORE ||
+            (rc == READ_SOME && hup))
+        {
+            continue;
+        }
+
+        break;
+    }
+}
+
+void EpollReactor::Flush(EpollEntry *e)
+{
+    // stays set while the socket is full, EPOLLOUT picks it up
+    e->want_write = WriteReady(e);
+}
+
+void EpollReactor::Poll(long timeout)
+{
+    std::vector<int> pending;
+    pending.swap(m_pending);
+
+    for (int fd : pending)
+    {
+        auto *e = static_cast<EpollEntry*>(Find(fd));
+
+        if (!e)
+            continue;
+
+        if (e->want_write)
+            Flush(e);
+
+        if (!e->dead && e->resume)
+        {
+            e->resume = false;
+            ReadAll(e, true);
+        }
+    }
+
+    if (!m_pending.empty())
+        timeout = 0;
+
+    struct epoll_event events[256];
+
+    int n = epoll_wait(m_epfd, events, 256, timeout);
+
+    for (int i = 0; i < n; ++i)
+    {
+        auto *e = static_cast<EpollEntry*>(events[i].data.ptr);
+        uint32_t ev = events[i].events;
+
+        if (e->dead)
+            continue;
+
+        bool hup = (ev & (EPOLLRDHUP | EPOLLHUP | EPOLLERR));
+
+        if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            ReadAll(e, hup);
+
+        if (!e->dead &&
+            e->want_write &&
+            (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+        {
+            Flush(e);
+        }
+    }
+}
+
+OOLONG_NS_END
@@ -0,0 +1,70 @@
+#ifndef OOLONG_EPOLL_REACTOR_H
+#define OOLONG_EPOLL_REACTOR_H
+
+#include "reactor.h"
+
+OOLONG_NS_BEGIN
+
+// edge-triggered epoll. listeners and streams are switched to
+// non-blocking, output is flushed once per round before waiting.
+class EpollReactor : public Reactor
+{
+public:
+    EpollReactor();
+    virtual ~EpollReactor();
+
+    Backend Type() const override;
+
+    int AddListener(int fd, Handler *h) override;
+
+    int AddStream(int fd, Handler *h) override;
+
+    int AddWatch(int fd, Handler *h) override;
+
+    int Remove(int fd) override;
+
+    int EnableRead(int fd, bool on) override;
+
+    int WantWrite(int fd) override;
+
+protected:
+    int Init() override;
+
+    void Poll(long timeout) override;
+
+private:
+    struct EpollEntry : public Entry
+    {
+        EpollEntry(int f, Kind k, Handler *handler)
+            : Entry(f, k, handler),
+              paused(false),
+              resume(false),
+              want_write(false)
+        {
+        }
+
+        bool paused;
+
+        // read what came in while paused
+        bool resume;
+
+        // output not flushed yet, or the socket was full
+        bool want_write;
+    };
+
+    int Add(int fd, Kind kind, Handler *h);
+
+    // read until the edge is used up
+    void ReadAll(EpollEntry *e, bool hup);
+
+    void Flush(EpollEntry *e);
+
+    int m_epfd;
+
+    // entries with output or a resume to take care of
+    std::vector<int> m_pending;
+};
+
+OOLONG_NS_END
+
+#endif
@@ -0,0 +1,208 @@
+#include <errno.h>
+
+#include "event_reactor.h"
+
+OOLONG_NS_BEGIN
+
+EventReactor::EventEntry::~EventEntry()
+{
+    for (auto *e : ev)
+    {
+        if (e)
+            event_free(e);
+    }
+}
+
+EventReactor::EventReactor()
+    : m_ev_base(NULL),
+      m_timer_ev(NULL)
+{
+}
+
+EventReactor::~EventReactor()
+{
+    // entries hold events of the base, let them go first
+    Clear();
+
+    if (m_timer_ev)
+        event_free(m_timer_ev);
+
+    if (m_ev_base)
+        event_base_free(m_ev_base);
+}
+
+Reactor::Backend EventReactor::Type() const
+{
+    return LIBEVENT;
+}
+
+int EventReactor::Init()
+{
+    m_ev_base = event_base_new();
+
+    if (!m_ev_base)
+        return -1;
+
+    m_timer_ev = evtimer_new(m_ev_base, OnTimeout, this);
+
+    if (!m_timer_ev)
+        return -1;
+
+    return AddWatch(m_wake_fd, &m_waker);
+}
+
+void EventReactor::Poll(long timeout)
+{
+    if (timeout >= 0)
+    {
+        struct timeval tv;
+
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+
+        evtimer_add(m_timer_ev, &tv);
+    }
+    else
+    {
+        evtimer_del(m_timer_ev);
+    }
+
+    event_base_loop(m_ev_base, EVLOOP_ONCE);
+}
+
+int EventReactor::Add(int fd, Kind kind, Handler *h)
+{
+    if (fd < 0 || !h)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    auto *e = new (std::nothrow) EventEntry(this, fd, kind, h);
+
+    if (!e)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    e->ev[0] = event_new(m_ev_base,
+                         fd,
+                         EV_READ | EV_PERSIST,
+                         OnRead,
+                         e);
+
+    if (kind == STREAM)
+    {
+        e->ev[1] = event_new(m_ev_base,
+                             fd,
+                             EV_WRITE | EV_PERSIST,
+                             OnWrite,
+                             e);
+    }
+
+    if (!e->ev[0] ||
+        (kind == STREAM && !e->ev[1]))
+    {
+        delete e;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    event_add(e->ev[0], NULL);
+
+    return Insert(e);
+}
+
+int EventReactor::AddListener(int fd, Handler *h)
+{
+    return Add(fd, LISTENER, h);
+}
+
+int EventReactor::AddStream(int fd, Handler *h)
+{
+    return Add(fd, STREAM, h);
+}
+
+int EventReactor::AddWatch(int fd, Handler *h)
+{
+    return Add(fd, WATCH, h);
+}
+
+int EventReactor::Remove(int fd)
+{
+    auto e = Take(fd);
+
+    if (!e)
+        return -1;
+
+    auto *ee = static_cast<EventEntry*>(e.get());
+
+    // nothing fires for it from now on
+    for (auto *ev : ee->ev)
+    {
+        if (ev)
+            event_del(ev);
+    }
+
+    Retire(std::move(e));
+    return 0;
+}
+
+int EventReactor::EnableRead(int fd, bool on)
+{
+    auto *e = static_cast<EventEntry*>(Find(fd));
+
+    if (!e)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return on ? event_add(e->ev[0], NULL) : event_del(e->ev[0]);
+}
+
+int EventReactor::WantWrite(int fd)
+{
+    auto *e = static_cast<EventEntry*>(Find(fd));
+
+    if (!e || !e->ev[1])
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return event_add(e->ev[1], NULL);
+}
+
+void EventReactor::OnRead(int, short, void *userdata)
+{
+    auto *e = static_cast<EventEntry*>(userdata);
+
+    if (e->dead)
+        return;
+
+    e->reactor->ReadReady(e);
+}
+
+void EventReactor::OnWrite(int, short, void *userdata)
+{
+    auto *e = static_cast<EventEntry*>(userdata);
+
+    if (e->dead)
+        return;
+
+    if (!e->reactor->WriteReady(e) &&
+        !e->dead)
+    {
+        // drained, wait for the next WantWrite
+        event_del(e->ev[1]);
+    }
+}
+
+void EventReactor::OnTimeout(int, short, void*)
+{
+    // only there to end event_base_loop, timers run in Run()
+}
+
+OOLONG_NS_END
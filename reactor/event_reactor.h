@@ -0,0 +1,68 @@
+#ifndef OOLONG_EVENT_REACTOR_H
+#define OOLONG_EVENT_REACTOR_H
+
+#include <event2/event.h>
+
+#include "reactor.h"
+
+OOLONG_NS_BEGIN
+
+// readiness reactor on top of libevent
+class EventReactor : public Reactor
+{
+public:
+    EventReactor();
+    virtual ~EventReactor();
+
+    Backend Type() const override;
+
+    int AddListener(int fd, Handler *h) override;
+
+    int AddStream(int fd, Handler *h) override;
+
+    int AddWatch(int fd, Handler *h) override;
+
+    int Remove(int fd) override;
+
+    int EnableRead(int fd, bool on) override;
+
+    int WantWrite(int fd) override;
+
+protected:
+    int Init() override;
+
+    void Poll(long timeout) override;
+
+private:
+    struct EventEntry : public Entry
+    {
+        EventEntry(EventReactor *r, int f, Kind k, Handler *handler)
+            : Entry(f, k, handler),
+              reactor(r),
+              ev { NULL, NULL }
+        {
+        }
+
+        ~EventEntry();
+
+        EventReactor *reactor;
+
+        // read and write
+        struct event *ev[2];
+    };
+
+    int Add(int fd, Kind kind, Handler *h);
+
+    static void OnRead(int, short, void*);
+    static void OnWrite(int, short, void*);
+    static void OnTimeout(int, short, void*);
+
+    struct event_base *m_ev_base;
+
+    // bounds a Poll() by the next timer
+    struct event *m_timer_ev;
+};
+
+OOLONG_NS_END
+
+#endif
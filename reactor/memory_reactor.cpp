@@ -0,0 +1,345 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include <algorithm>
+
+#include "memory_reactor.h"
+
+OOLONG_NS_BEGIN
+
+MemoryReactor::MemoryReactor()
+    : m_listener(-1),
+      m_now(0)
+{
+}
+
+MemoryReactor::~MemoryReactor()
+{
+    Clear();
+}
+
+Reactor::Backend MemoryReactor::Type() const
+{
+    return MEMORY;
+}
+
+int MemoryReactor::Init()
+{
+    return AddWatch(m_wake_fd, &m_waker);
+}
+
+uint64_t MemoryReactor::Now()
+{
+    return m_now;
+}
+
+void MemoryReactor::Advance(long ms)
+{
+    if (ms > 0)
+        m_now += ms;
+}
+
+int MemoryReactor::AddListener(int fd, Handler *h)
+{
+    if (fd < 0 || !h)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (Insert(new (std::nothrow) MemoryEntry(fd, LISTENER, h)) < 0)
+        return -1;
+
+    if (m_listener < 0)
+        m_listener = fd;
+
+    return 0;
+}
+
+int MemoryReactor::AddStream(int fd, Handler *h)
+{
+    if (fd < 0 || !h)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return Insert(new (std::nothrow) MemoryEntry(fd, STREAM, h));
+}
+
+int MemoryReactor::AddWatch(int fd, Handler *h)
+{
+    if (fd < 0 || !h)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (Insert(new (std::nothrow) MemoryEntry(fd, WATCH, h)) < 0)
+        return -1;
+
+    m_watches.push_back(fd);
+    return 0;
+}
+
+int MemoryReactor::Remove(int fd)
+{
+    auto e = Take(fd);
+
+    if (!e)
+        return -1;
+
+    if (fd == m_listener)
+        m_listener = -1;
+
+    if (e->kind == WATCH)
+        m_watches.erase(std::find(m_watches.begin(), m_watches.end(), fd));
+
+    Retire(std::move(e));
+
+    auto it = m_peers.find(fd);
+
+    if (it != m_peers.end())
+    {
+        // the fd number may come back with the next connection
+        auto peer = std::move(it->second);
+        m_peers.erase(it);
+
+        peer(NULL, 0);
+    }
+
+    return 0;
+}
+
+int MemoryReactor::EnableRead(int fd, bool on)
+{
+    auto *e = static_cast<MemoryEntry*>(Find(fd));
+
+    if (!e)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (e->paused && on)
+        m_events.push_back(Event { MEM_RESUME, fd, "" });
+
+    e->paused = !on;
+    return 0;
+}
+
+int MemoryReactor::WantWrite(int fd)
+{
+    auto *e = static_cast<MemoryEntry*>(Find(fd));
+
+    if (!e || e->kind != STREAM)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (!e->want_write)
+    {
+        e->want_write = true;
+        m_events.push_back(Event { MEM_WRITE, fd, "" });
+    }
+
+    return 0;
+}
+
+int MemoryReactor::Connect(Peer peer)
+{
+    if (m_listener < 0 || !peer)
+    {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    // a real fd number, the server closes it like a socket
+    int fd = eventfd(0, EFD_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    m_peers[fd] = std::move(peer);
+    m_events.push_back(Event { MEM_ACCEPT, fd, "" });
+
+    return fd;
+}
+
+int MemoryReactor::Inject(int fd, const char *data, size_t n)
+{
+    if (!m_peers.count(fd))
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    m_events.push_back(Event { MEM_DATA, fd, std::string(data, n) });
+    return 0;
+}
+
+int MemoryReactor::Hangup(int fd)
+{
+    if (!m_peers.count(fd))
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    m_events.push_back(Event { MEM_EOF, fd, "" });
+    return 0;
+}
+
+void MemoryReactor::Deliver(MemoryEntry *e)
+{
+    while (!e->dead &&
+           !e->paused &&
+           !e->input.empty())
+    {
+        size_t len = 0;
+        char *buf = e->h->RecvBuffer(&len);
+
+        if (!buf || !len)
+        {
+            // hand over all of it from our own buffer
+            std::string data;
+            data.swap(e->input);
+
+            e->h->OnRecv(data.data(), data.size());
+            continue;
+        }
+
+        size_t n = std::min(len, e->input.size());
+
+        memcpy(buf, e->input.data(), n);
+        e->input.erase(0, n);
+
+        e->h->OnRecv(buf, n);
+    }
+
+    if (!e->dead &&
+        !e->paused &&
+        e->eof)
+    {
+        e->eof = false;
+        e->h->OnRecv(NULL, 0);
+    }
+}
+
+void MemoryReactor::Dispatch(Event &ev)
+{
+    if (ev.type == MEM_ACCEPT)
+    {
+        auto *l = static_cast<MemoryEntry*>(Find(m_listener));
+
+        if (!l)
+        {
+            Remove(ev.fd);
+            close(ev.fd);
+            return;
+        }
+
+        l->h->OnAccept(ev.fd);
+        return;
+    }
+
+    auto *e = static_cast<MemoryEntry*>(Find(ev.fd));
+
+    if (!e || e->kind != STREAM)
+        return;
+
+    switch (ev.type)
+    {
+    case MEM_DATA:
+        e->input.append(ev.data);
+        Deliver(e);
+        break;
+
+    case MEM_EOF:
+        e->eof = true;
+        Deliver(e);
+        break;
+
+    case MEM_RESUME:
+        Deliver(e);
+        break;
+
+    case MEM_WRITE:
+    {
+        struct iovec iov[16];
+
+        e->want_write = false;
+
+        // the peer takes everything at once
+        while (!e->dead)
+        {
+            int cnt = e->h->PendingOutput(iov, 16);
+
+            if (cnt <= 0)
+                break;
+
+            size_t total = 0;
+
+            for (int i = 0; i < cnt; ++i)
+            {
+                auto it = m_peers.find(e->fd);
+
+                if (it != m_peers.end())
+                    it->second((const char*) iov[i].iov_base, iov[i].iov_len);
+
+                total += iov[i].iov_len;
+            }
+
+            e->h->OnSent(total);
+        }
+
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+void MemoryReactor::Poll(long timeout)
+{
+    // events queued by this round's handlers wait for the next one
+    size_t n = m_events.size();
+
+    while (n-- && !m_events.empty())
+    {
+        Event ev = std::move(m_events.front());
+        m_events.pop_front();
+
+        Dispatch(ev);
+    }
+
+    // watches are real fds, block on them only when there's nothing
+    // else to do. timers don't move the clock, Advance() does
+    std::vector<struct pollfd> fds;
+
+    for (int fd : m_watches)
+        fds.push_back(pollfd { fd, POLLIN, 0 });
+
+    int wait = m_events.empty() ? (int) timeout : 0;
+
+    if (poll(fds.data(), fds.size(), wait) <= 0)
+        return;
+
+    for (auto &p : fds)
+    {
+        if (!(p.revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+        Entry *e = Find(p.fd);
+
+        if (e && e->kind == WATCH)
+            e->h->OnReadable();
+    }
+}
+
+OOLONG_NS_END
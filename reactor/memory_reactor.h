@@ -0,0 +1,112 @@
+#ifndef OOLONG_MEMORY_REACTOR_H
+#define OOLONG_MEMORY_REACTOR_H
+
+#include <deque>
+
+#include "reactor.h"
+
+OOLONG_NS_BEGIN
+
+// deterministic reactor without sockets underneath, for tests and for
+// measuring the server without the kernel. connections are made up in
+// memory, their events are handled in the order they were queued, and
+// timers follow a clock that only moves on Advance(). watches still
+// poll real fds, so wakeups and doorbells work as usual.
+class MemoryReactor : public Reactor
+{
+public:
+    // server output, or (NULL, 0) once the server dropped the connection
+    typedef std::function<void(const char *data, size_t n)> Peer;
+
+    MemoryReactor();
+    virtual ~MemoryReactor();
+
+    Backend Type() const override;
+
+    int AddListener(int fd, Handler *h) override;
+
+    int AddStream(int fd, Handler *h) override;
+
+    int AddWatch(int fd, Handler *h) override;
+
+    int Remove(int fd) override;
+
+    int EnableRead(int fd, bool on) override;
+
+    int WantWrite(int fd) override;
+
+    // connect to the first listener, returns the connection's fd.
+    // the calls below are loop thread only, like the rest
+    int Connect(Peer peer);
+
+    // bytes from the peer
+    int Inject(int fd, const char *data, size_t n);
+
+    // peer closed
+    int Hangup(int fd);
+
+    // move the clock on
+    void Advance(long ms);
+
+protected:
+    int Init() override;
+
+    void Poll(long timeout) override;
+
+    uint64_t Now() override;
+
+private:
+    enum EventType
+    {
+        MEM_ACCEPT,
+        MEM_DATA,
+        MEM_EOF,
+        MEM_WRITE,
+        MEM_RESUME,
+    };
+
+    struct Event
+    {
+        EventType type;
+        int fd;
+        std::string data;
+    };
+
+    struct MemoryEntry : public Entry
+    {
+        MemoryEntry(int f, Kind k, Handler *handler)
+            : Entry(f, k, handler),
+              paused(false),
+              eof(false),
+              want_write(false)
+        {
+        }
+
+        bool paused;
+
+        // input held back while paused
+        std::string input;
+        bool eof;
+
+        bool want_write;
+    };
+
+    void Dispatch(Event &ev);
+
+    void Deliver(MemoryEntry *e);
+
+    int m_listener;
+
+    uint64_t m_now;
+
+    std::deque<Event> m_events;
+
+    std::vector<int> m_watches;
+
+    // peers by connection fd
+    std::map<int, Peer> m_peers;
+};
+
+OOLONG_NS_END
+
+#endif
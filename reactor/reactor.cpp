@@ -0,0 +1,485 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <new>
+
+#include "event_reactor.h"
+#include "uring_reactor.h"
+#include "epoll_reactor.h"
+#include "memory_reactor.h"
+
+#include "reactor.h"
+
+OOLONG_NS_BEGIN
+
+static uint64_t NowMS()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Reactor* Reactor::Create(Backend b)
+{
+    std::unique_ptr<Reactor> r;
+
+    switch (b)
+    {
+    case LIBEVENT:
+        r.reset(new (std::nothrow) EventReactor());
+        break;
+    case IO_URING:
+        r.reset(new (std::nothrow) UringReactor());
+        break;
+    case EPOLL:
+        r.reset(new (std::nothrow) EpollReactor());
+        break;
+    case MEMORY:
+        r.reset(new (std::nothrow) MemoryReactor());
+        break;
+    }
+
+    if (!r ||
+        r->m_wake_fd < 0 ||
+        r->Init() < 0)
+    {
+        return NULL;
+    }
+
+    return r.release();
+}
+
+const char* Reactor::Name(Backend b)
+{
+    switch (b)
+    {
+    case LIBEVENT:
+        return "libevent";
+    case IO_URING:
+        return "io_uring";
+    case EPOLL:
+        return "epoll";
+    case MEMORY:
+        return "memory";
+    }
+
+    return "unknown";
+}
+
+int Reactor::Parse(const std::string &name, Backend *b)
+{
+    for (auto t : { LIBEVENT, IO_URING, EPOLL, MEMORY })
+    {
+        if (name == Name(t))
+        {
+            *b = t;
+            return 0;
+        }
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+Reactor::Reactor()
+    : m_wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      m_waker(m_wake_fd),
+      m_stop(false),
+      m_loop_tid(std::this_thread::get_id()),
+      m_scratch(64 * 1024),
+      m_accept_batch(64),
+      m_timer_seq(0)
+{
+}
+
+Reactor::~Reactor()
+{
+    if (m_wake_fd >= 0)
+        close(m_wake_fd);
+}
+
+int Reactor::Run()
+{
+    m_loop_tid = std::this_thread::get_id();
+
+    while (!m_stop)
+    {
+        RunOnce(NextTimer());
+    }
+
+    return 0;
+}
+
+void Reactor::RunOnce(long timeout)
+{
+    Poll(timeout);
+
+    RunTimers();
+    RunPosted();
+
+    // callbacks have unwound, removed entries can go
+    m_garbage.clear();
+}
+
+void Reactor::Stop()
+{
+    m_stop = true;
+
+    uint64_t n = 1;
+
+    if (write(m_wake_fd, &n, sizeof(n)) < 0)
+    {
+        ;
+    }
+}
+
+bool Reactor::InLoop() const
+{
+    return (std::this_thread::get_id() == m_loop_tid);
+}
+
+Reactor::TimerId Reactor::AddTimer(long delay,
+                                   std::function<void()> fn,
+                                   bool repeat)
+{
+    if (!fn)
+        return 0;
+
+    delay = std::max(delay, 0L);
+
+    TimerId id = ++m_timer_seq;
+    uint64_t due = Now() + delay;
+
+    m_timers.emplace(id, Timer { due, repeat ? delay : -1, std::move(fn) });
+    m_timer_queue.emplace(due, id);
+
+    return id;
+}
+
+void Reactor::SetAcceptBatch(int n)
+{
+    m_accept_batch = std::max(n, 1);
+}
+
+void Reactor::CancelTimer(TimerId id)
+{
+    auto it = m_timers.find(id);
+
+    if (it == m_timers.end())
+        return;
+
+    m_timer_queue.erase(std::make_pair(it->second.due, id));
+    m_timers.erase(it);
+}
+
+long Reactor::NextTimer()
+{
+    if (m_timer_queue.empty())
+        return -1;
+
+    uint64_t now = Now();
+    uint64_t due = m_timer_queue.begin()->first;
+
+    return (due > now) ? (long) (due - now) : 0;
+}
+
+uint64_t Reactor::Now()
+{
+    return NowMS();
+}
+
+void Reactor::RunTimers()
+{
+    uint64_t now = Now();
+
+    while (!m_timer_queue.empty() &&
+           m_timer_queue.begin()->first <= now)
+    {
+        TimerId id = m_timer_queue.begin()->second;
+        m_timer_queue.erase(m_timer_queue.begin());
+
+        auto it = m_timers.find(id);
+
+        if (it == m_timers.end())
+            continue;
+
+        auto &t = it->second;
+
+        if (t.period < 0)
+        {
+            auto fn = std::move(t.fn);
+            m_timers.erase(it);
+
+            fn();
+            continue;
+        }
+
+        // fn may cancel its own timer
+        auto fn = t.fn;
+
+        t.due = now + std::max(t.period, 1L);
+        m_timer_queue.emplace(t.due, id);
+
+        fn();
+    }
+}
+
+int Reactor::Post(std::function<void()> fn)
+{
+    if (!fn)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    {
+        std::unique_lock<std::mutex>
+            lock(m_post_lock);
+
+        m_posted.emplace_back(std::move(fn));
+
+        // one wakeup per batch
+        if (m_posted.size() > 1)
+            return 0;
+    }
+
+    uint64_t n = 1;
+
+    if (write(m_wake_fd, &n, sizeof(n)) < 0)
+        return -1;
+
+    return 0;
+}
+
+void Reactor::RunPosted()
+{
+    std::vector<std::function<void()>> jobs;
+
+    {
+        std::unique_lock<std::mutex>
+            lock(m_post_lock);
+
+        if (m_posted.empty())
+            return;
+
+        jobs.swap(m_posted);
+    }
+
+    for (auto &fn : jobs)
+    {
+        fn();
+    }
+}
+
+void Reactor::Waker::OnReadable()
+{
+    uint64_t n;
+
+    if (read(m_fd, &n, sizeof(n)) < 0)
+    {
+        ;
+    }
+}
+
+Reactor::Entry* Reactor::Find(int fd)
+{
+    auto it = m_entries.find(fd);
+
+    if (it == m_entries.end())
+        return NULL;
+
+    return it->second.get();
+}
+
+int Reactor::Insert(Entry *e)
+{
+    std::unique_ptr<Entry> p(e);
+
+    if (!p)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (m_entries.count(p->fd))
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+    m_entries.emplace(p->fd, std::move(p));
+    return 0;
+}
+
+std::unique_ptr<Reactor::Entry> Reactor::Take(int fd)
+{
+    auto it = m_entries.find(fd);
+
+    if (it == m_entries.end())
+    {
+        errno = ENOENT;
+        return nullptr;
+    }
+
+    std::unique_ptr<Entry> e = std::move(it->second);
+    m_entries.erase(it);
+
+    e->dead = true;
+    return e;
+}
+
+void Reactor::Retire(std::unique_ptr<Entry> e)
+{
+    if (e)
+        m_garbage.emplace_back(std::move(e));
+}
+
+void Reactor::Clear()
+{
+    m_garbage.clear();
+    m_entries.clear();
+}
+
+int Reactor::ReadReady(Entry *e)
+{
+    switch (e->kind)
+    {
+    case LISTENER:
+    {
+        // drain the accept queue, but leave the loop to others now
+        // and then during a storm
+        for (int i = 0; i < m_accept_batch; ++i)
+        {
+            struct sockaddr_storage addr;
+            socklen_t addrlen = sizeof(addr);
+
+            int conn = accept4(e->fd,
+                               (struct sockaddr*) &addr,
+                               &addrlen,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+            if (conn < 0)
+            {
+                if (errno == EAGAIN ||
+                    errno == EWOULDBLOCK)
+                {
+                    return READ_DONE;
+                }
+
+                // the peer gave up while queued
+                if (errno == EINTR ||
+                    errno == ECONNABORTED)
+                {
+                    continue;
+                }
+
+                e->h->OnError(errno);
+                return READ_DONE;
+            }
+
+            e->h->OnAccept(conn);
+
+            if (e->dead)
+                return READ_DONE;
+        }
+
+        return READ_MORE;
+    }
+
+    case STREAM:
+    {
+        size_t len = 0;
+        char *buf = e->h->RecvBuffer(&len);
+
+        if (!buf || !len)
+        {
+            buf = m_scratch.data();
+            len = m_scratch.size();
+        }
+
+        ssize_t n = read(e->fd, buf, len);
+
+        if (n < 0 &&
+            (errno == EAGAIN ||
+             errno == EWOULDBLOCK))
+        {
+            return READ_DONE;
+        }
+
+        if (n < 0 &&
+            errno == EINTR)
+        {
+            return READ_MORE;
+        }
+
+        e->h->OnRecv(buf, n);
+
+        if (n <= 0)
+            return READ_DONE;
+
+        // a short read usually drained the socket
+        return ((size_t) n == len) ? READ_MORE : READ_SOME;
+    }
+
+    case WATCH:
+        e->h->OnReadable();
+        return READ_DONE;
+    }
+
+    return READ_DONE;
+}
+
+bool Reactor::WriteReady(Entry *e)
+{
+    struct iovec iov[16];
+
+    // handlers may remove the entry, look at e->dead after each call
+    while (!e->dead)
+    {
+        int cnt = e->h->PendingOutput(iov, 16);
+
+        if (cnt <= 0)
+            return false;
+
+        size_t total = 0;
+
+        for (int i = 0; i < cnt; ++i)
+            total += iov[i].iov_len;
+
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+
+        ssize_t n = sendmsg(e->fd, &msg, MSG_NOSIGNAL);
+
+        if (n < 0)
+        {
+            if (errno == EAGAIN ||
+                errno == EWOULDBLOCK ||
+                errno == EINTR)
+            {
+                return true;
+            }
+
+            e->h->OnError(errno);
+            return false;
+        }
+
+        e->h->OnSent(n);
+
+        if ((size_t) n < total)
+        {
+            // socket is full
+            return !e->dead;
+        }
+    }
+
+    return false;
+}
+
+OOLONG_NS_END
@@ -0,0 +1,238 @@
+#ifndef OOLONG_REACTOR_H
+#define OOLONG_REACTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+
+#include "oolong.h"
+
+OOLONG_NS_BEGIN
+
+// the event loop a server runs on. handlers are called on the loop
+// thread, and so must every method be called except Post() and Stop().
+class Reactor
+{
+public:
+    enum Backend
+    {
+        LIBEVENT,
+        IO_URING,
+        EPOLL,
+        MEMORY,
+    };
+
+    class Handler
+    {
+    public:
+        virtual ~Handler() {}
+
+        // listener: a connection was accepted
+        virtual void OnAccept(int) {}
+
+        // listener: accepting failed, stream: sending failed
+        virtual void OnError(int) {}
+
+        // stream: where to read into, NULL lets the reactor pick
+        virtual char* RecvBuffer(size_t*) { return NULL; }
+
+        // stream: n bytes arrived at data, 0 on eof, < 0 on error
+        virtual void OnRecv(const char*, ssize_t) {}
+
+        // stream: bytes waiting to be sent, returns iov count
+        virtual int PendingOutput(struct iovec*, int) { return 0; }
+
+        // stream: keeps the bytes of the last PendingOutput(), cnt
+        // iovecs, alive and unchanged until OnSent(). for backends that
+        // send after returning, NULL has them copy instead
+        virtual std::shared_ptr<void> HoldOutput(int) { return nullptr; }
+
+        // stream: the first n bytes of the output are taken care of
+        virtual void OnSent(size_t) {}
+
+        // watch: fd is readable
+        virtual void OnReadable() {}
+    };
+
+    typedef uint64_t TimerId;
+
+    // NULL if the backend is not available here
+    static Reactor* Create(Backend b);
+
+    static const char* Name(Backend b);
+
+    // "libevent", "io_uring", "epoll", "memory"
+    static int Parse(const std::string &name, Backend *b);
+
+    virtual ~Reactor();
+
+    virtual Backend Type() const = 0;
+
+    // dispatch until Stop()
+    int Run();
+
+    // a single round, for driving the loop by hand
+    void RunOnce(long timeout);
+
+    void Stop();
+
+    bool InLoop() const;
+
+    virtual int AddListener(int fd, Handler *h) = 0;
+
+    virtual int AddStream(int fd, Handler *h) = 0;
+
+    virtual int AddWatch(int fd, Handler *h) = 0;
+
+    // forget fd before closing it, its handler is not called again
+    virtual int Remove(int fd) = 0;
+
+    // pause or resume OnRecv
+    virtual int EnableRead(int fd, bool on) = 0;
+
+    // stream has PendingOutput
+    virtual int WantWrite(int fd) = 0;
+
+    // run fn once delay (millisec) expired, and every delay if repeat
+    TimerId AddTimer(long delay,
+                     std::function<void()> fn,
+                     bool repeat = false);
+
+    void CancelTimer(TimerId id);
+
+    // connections a listener accepts per wakeup before the loop moves
+    // on to other work, the rest are picked up in the next round
+    void SetAcceptBatch(int n);
+
+    // run fn on the loop thread, after the current callback
+    int Post(std::function<void()> fn);
+
+protected:
+    enum Kind
+    {
+        LISTENER,
+        STREAM,
+        WATCH,
+    };
+
+    struct Entry
+    {
+        Entry(int f, Kind k, Handler *handler)
+            : fd(f),
+              kind(k),
+              h(handler),
+              dead(false)
+        {
+        }
+
+        virtual ~Entry() {}
+
+        int fd;
+        Kind kind;
+        Handler *h;
+
+        // removed, only kept until callbacks unwind
+        bool dead;
+    };
+
+    Reactor();
+
+    virtual int Init() = 0;
+
+    // wait up to timeout (millisec, < 0 forever) and dispatch
+    virtual void Poll(long timeout) = 0;
+
+    Entry* Find(int fd);
+
+    int Insert(Entry *e);
+
+    // unlink fd, the entry is marked dead
+    std::unique_ptr<Entry> Take(int fd);
+
+    // free e once the current loop iteration is over
+    void Retire(std::unique_ptr<Entry> e);
+
+    // free every entry, backends call it before tearing down
+    void Clear();
+
+    // millisec clock timers run on
+    virtual uint64_t Now();
+
+    // readiness backends, fd is readable. returns READ_MORE when fd
+    // most likely has more (for listeners: the batch is used up),
+    // READ_SOME when it may have
+    enum
+    {
+        READ_DONE,
+        READ_SOME,
+        READ_MORE,
+    };
+
+    int ReadReady(Entry *e);
+
+    // readiness backends, fd is writable. false once drained
+    bool WriteReady(Entry *e);
+
+    int m_wake_fd;
+
+    // drains m_wake_fd, backends watch it
+    class Waker : public Handler
+    {
+    public:
+        Waker(int fd) : m_fd(fd) {}
+
+        void OnReadable() override;
+
+    private:
+        int m_fd;
+    };
+
+    Waker m_waker;
+
+private:
+    void RunTimers();
+
+    long NextTimer();
+
+    void RunPosted();
+
+    std::atomic<bool> m_stop;
+
+    std::thread::id m_loop_tid;
+
+    std::unordered_map<int, std::unique_ptr<Entry>> m_entries;
+    std::vector<std::unique_ptr<Entry>> m_garbage;
+
+    std::vector<char> m_scratch;
+
+    int m_accept_batch;
+
+    struct Timer
+    {
+        uint64_t due;
+        long period;
+        std::function<void()> fn;
+    };
+
+    TimerId m_timer_seq;
+    std::map<TimerId, Timer> m_timers;
+    std::set<std::pair<uint64_t, TimerId>> m_timer_queue;
+
+    std::mutex m_post_lock;
+    std::vector<std::function<void()>> m_posted;
+};
+
+OOLONG_NS_END
+
+#endif
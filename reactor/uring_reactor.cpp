@@ -0,0 +1,715 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "uring_reactor.h"
+
+OOLONG_NS_BEGIN
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd,
+                       unsigned to_submit,
+                       unsigned min_complete,
+                       unsigned flags,
+                       void *arg,
+                       size_t argsz)
+{
+    return (int) syscall(__NR_io_uring_enter,
+                         fd,
+                         to_submit,
+                         min_complete,
+                         flags,
+                         arg,
+                         argsz);
+}
+
+static int uring_register(int fd, unsigned op, void *arg, unsigned nr)
+{
+    return (int) syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+// entries are 8-byte aligned, the op goes into the low bits
+static inline uint64_t UserData(void *e, int op)
+{
+    return (uint64_t) (uintptr_t) e | op;
+}
+
+UringReactor::UringReactor()
+    : m_ring_fd(-1),
+      m_sq_ptr(NULL),
+      m_sq_size(0),
+      m_cq_ptr(NULL),
+      m_cq_size(0),
+      m_sqes(NULL),
+      m_sqes_size(0),
+      m_sq_head(NULL),
+      m_sq_tail(NULL),
+      m_sq_array(NULL),
+      m_sq_mask(0),
+      m_sq_entries(0),
+      m_sq_pending(0),
+      m_sq_flushed(0),
+      m_cq_head(NULL),
+      m_cq_tail(NULL),
+      m_cq_mask(0),
+      m_cqes(NULL),
+      m_buf_ring(NULL),
+      m_buf_ring_size(0),
+      m_bufs(NULL),
+      m_buf_tail(0)
+{
+}
+
+UringReactor::~UringReactor()
+{
+    // the kernel drops whatever is in flight with the ring
+    if (m_ring_fd >= 0)
+        close(m_ring_fd);
+
+    if (m_bufs)
+        munmap(m_bufs, (size_t) BUF_COUNT * BUF_SIZE);
+
+    if (m_buf_ring)
+        munmap(m_buf_ring, m_buf_ring_size);
+
+    if (m_sqes)
+        munmap(m_sqes, m_sqes_size);
+
+    if (m_cq_ptr && m_cq_ptr != m_sq_ptr)
+        munmap(m_cq_ptr, m_cq_size);
+
+    if (m_sq_ptr)
+        munmap(m_sq_ptr, m_sq_size);
+
+    m_zombies.clear();
+    Clear();
+}
+
+Reactor::Backend UringReactor::Type() const
+{
+    return IO_URING;
+}
+
+static void* MapRing(int fd, size_t size, off_t offset)
+{
+    void *p = mmap(NULL,
+                   size,
+                   PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE,
+                   fd,
+                   offset);
+
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+int UringReactor::Init()
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+
+    m_ring_fd = uring_setup(SQ_ENTRIES, &p);
+
+    if (m_ring_fd < 0)
+        return -1;
+
+    // timed waits need the extended enter args (5.11)
+    if (!(p.features & IORING_FEAT_EXT_ARG))
+    {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+    }
+
+    m_sq_ptr = MapRing(m_ring_fd, m_sq_size, IORING_OFF_SQ_RING);
+
+    if (!m_sq_ptr)
+        return -1;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        m_cq_ptr = m_sq_ptr;
+    }
+    else
+    {
+        m_cq_ptr = MapRing(m_ring_fd, m_cq_size, IORING_OFF_CQ_RING);
+
+        if (!m_cq_ptr)
+            return -1;
+    }
+
+    m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = static_cast<struct io_uring_sqe*>(
+                 MapRing(m_ring_fd, m_sqes_size, IORING_OFF_SQES));
+
+    if (!m_sqes)
+        return -1;
+
+    char *sq = static_cast<char*>(m_sq_ptr);
+    char *cq = static_cast<char*>(m_cq_ptr);
+
+    m_sq_head = (unsigned*) (sq + p.sq_off.head);
+    m_sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    m_sq_array = (unsigned*) (sq + p.sq_off.array);
+    m_sq_mask = *(unsigned*) (sq + p.sq_off.ring_mask);
+    m_sq_entries = *(unsigned*) (sq + p.sq_off.ring_entries);
+
+    m_sq_pending = m_sq_flushed = *m_sq_tail;
+
+    m_cq_head = (unsigned*) (cq + p.cq_off.head);
+    m_cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    m_cq_mask = *(unsigned*) (cq + p.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+    // receive buffers the kernel picks from (5.19)
+    m_buf_ring_size = BUF_COUNT * sizeof(struct io_uring_buf);
+
+    void *ring = mmap(NULL,
+                      m_buf_ring_size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1,
+                      0);
+
+    if (ring == MAP_FAILED)
+        return -1;
+
+    m_buf_ring = static_cast<struct io_uring_buf_ring*>(ring);
+
+    void *bufs = mmap(NULL,
+                      (size_t) BUF_COUNT * BUF_SIZE,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1,
+                      0);
+
+    if (bufs == MAP_FAILED)
+        return -1;
+
+    m_bufs = static_cast<char*>(bufs);
+
+    struct io_uring_buf_reg reg;
+
+    memset(&reg, 0, sizeof(reg));
+
+    reg.ring_addr = (uint64_t) (uintptr_t) m_buf_ring;
+    reg.ring_entries = BUF_COUNT;
+    reg.bgid = BUF_GROUP;
+
+    if (uring_register(m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+
+    for (int i = 0; i < BUF_COUNT; ++i)
+        Recycle(i);
+
+    return AddWatch(m_wake_fd, &m_waker);
+}
+
+void UringReactor::Recycle(uint16_t bid)
+{
+    // not through ->bufs, the flex array sits 8 bytes off in c++.
+    // the first entry shares its last field with the ring tail.
+    auto *bufs = reinterpret_cast<struct io_uring_buf*>(m_buf_ring);
+    auto &b = bufs[m_buf_tail & (BUF_COUNT - 1)];
+
+    b.addr = (uint64_t) (uintptr_t) (m_bufs + (size_t) bid * BUF_SIZE);
+    b.len = BUF_SIZE;
+    b.bid = bid;
+
+    ++m_buf_tail;
+
+    __atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+}
+
+unsigned UringReactor::SqSpace() const
+{
+    unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+
+    return m_sq_entries - (m_sq_pending - head);
+}
+
+struct io_uring_sqe* UringReactor::GetSqe()
+{
+    if (!SqSpace())
+    {
+        Submit(0, -1);
+
+        if (!SqSpace())
+        {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    unsigned idx = m_sq_pending & m_sq_mask;
+    auto *sqe = &m_sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    m_sq_array[idx] = idx;
+    ++m_sq_pending;
+
+    return sqe;
+}
+
+int UringReactor::Submit(unsigned wait, long timeout)
+{
+    __atomic_store_n(m_sq_tail, m_sq_pending, __ATOMIC_RELEASE);
+
+    unsigned n = m_sq_pending - m_sq_flushed;
+    m_sq_flushed = m_sq_pending;
+
+    if (!n && !wait)
+        return 0;
+
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    if (wait && timeout >= 0)
+    {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+
+    int rc = uring_enter(m_ring_fd, n, wait, flags, argp, argsz);
+
+    if (rc < 0 &&
+        (errno == ETIME ||
+         errno == EINTR))
+    {
+        return 0;
+    }
+
+    return rc;
+}
+
+void UringReactor::Poll(long timeout)
+{
+    // output handed to us since the last round, in one go
+    std::vector<int> want;
+    want.swap(m_want);
+
+    for (int fd : want)
+    {
+        auto *e = static_cast<UringEntry*>(Find(fd));
+
+        if (e &&
+            e->want_write &&
+            !e->sending)
+        {
+            Pull(e);
+        }
+    }
+
+    unsigned head = *m_cq_head;
+    bool ready = (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE));
+
+    Submit(ready ? 0 : 1, timeout);
+
+    for (;;)
+    {
+        unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail)
+            break;
+
+        // copy out, handlers may queue more work
+        struct io_uring_cqe cqe = m_cqes[head & m_cq_mask];
+
+        ++head;
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+
+        Complete(cqe);
+    }
+}
+
+int UringReactor::Add(int fd, Kind kind, Handler *h)
+{
+    if (fd < 0 || !h)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    auto *e = new (std::nothrow) UringEntry(fd, kind, h);
+
+    if (Insert(e) < 0)
+        return -1;
+
+    if (Arm(e) < 0)
+    {
+        int err = errno;
+        Retire(Take(fd));
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+int UringReactor::AddListener(int fd, Handler *h)
+{
+    return Add(fd, LISTENER, h);
+}
+
+int UringReactor::AddStream(int fd, Handler *h)
+{
+    return Add(fd, STREAM, h);
+}
+
+int UringReactor::AddWatch(int fd, Handler *h)
+{
+    return Add(fd, WATCH, h);
+}
+
+int UringReactor::Remove(int fd)
+{
+    auto p = Take(fd);
+
+    if (!p)
+        return -1;
+
+    auto *e = static_cast<UringEntry*>(p.get());
+
+    if (e->armed)
+        Cancel(e);
+
+    // the caller closes fd next, queued sends must hold it by then
+    Submit(0, -1);
+
+    // a send in flight still reads from e->hold
+    if (e->ops)
+        m_zombies.emplace(e, std::move(p));
+    else
+        Retire(std::move(p));
+
+    return 0;
+}
+
+int UringReactor::EnableRead(int fd, bool on)
+{
+    auto *e = static_cast<UringEntry*>(Find(fd));
+
+    if (!e)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    e->paused = !on;
+
+    if (on && !e->armed)
+        return Arm(e);
+
+    if (!on && e->armed)
+        Cancel(e);
+
+    return 0;
+}
+
+int UringReactor::WantWrite(int fd)
+{
+    auto *e = static_cast<UringEntry*>(Find(fd));
+
+    if (!e || e->kind != STREAM)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (!e->want_write)
+    {
+        e->want_write = true;
+        m_want.push_back(fd);
+    }
+
+    return 0;
+}
+
+int UringReactor::Arm(UringEntry *e)
+{
+    auto *sqe = GetSqe();
+
+    if (!sqe)
+        return -1;
+
+    sqe->fd = e->fd;
+
+    switch (e->kind)
+    {
+    case LISTENER:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        break;
+
+    case STREAM:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUF_GROUP;
+        break;
+
+    case WATCH:
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        break;
+    }
+
+    sqe->user_data = UserData(e, OP_ARM);
+
+    e->armed = true;
+    ++e->ops;
+
+    return 0;
+}
+
+void UringReactor::Cancel(UringEntry *e)
+{
+    auto *sqe = GetSqe();
+
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = UserData(e, OP_ARM);
+
+    // nobody cares about the cancel's own completion
+    sqe->user_data = 0;
+}
+
+void UringReactor::Pull(UringEntry *e)
+{
+    e->want_write = false;
+
+    int cnt = e->h->PendingOutput(e->iov, MAX_SENDS);
+
+    if (cnt <= 0)
+        return;
+
+    // the handler's own bytes if it can hold them, else a copy
+    e->hold = e->h->HoldOutput(cnt);
+
+    if (!e->hold)
+    {
+        e->copy.clear();
+
+        for (int i = 0; i < cnt; ++i)
+            e->copy.append((const char*) e->iov[i].iov_base, e->iov[i].iov_len);
+
+        e->iov[0].iov_base = &e->copy[0];
+        e->iov[0].iov_len = e->copy.size();
+        cnt = 1;
+    }
+
+    memset(&e->msg, 0, sizeof(e->msg));
+    e->msg.msg_iov = e->iov;
+    e->msg.msg_iovlen = cnt;
+
+    auto *sqe = GetSqe();
+
+    if (!sqe)
+    {
+        // the ring is full, next round
+        e->hold.reset();
+        WantWrite(e->fd);
+        return;
+    }
+
+    // one in flight, so a short send can't leave a gap before the next
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = e->fd;
+    sqe->addr = (uint64_t) (uintptr_t) &e->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = UserData(e, OP_SEND);
+
+    e->sending = true;
+    ++e->ops;
+}
+
+void UringReactor::Complete(const struct io_uring_cqe &cqe)
+{
+    if (!cqe.user_data)
+        return;
+
+    auto *e = reinterpret_cast<UringEntry*>(cqe.user_data & ~7ULL);
+
+    switch (cqe.user_data & 7)
+    {
+    case OP_ARM:
+        OnArm(e, cqe);
+        break;
+    case OP_SEND:
+        OnSend(e, cqe);
+        break;
+    }
+
+    if (e->dead && !e->ops)
+    {
+        auto it = m_zombies.find(e);
+
+        if (it != m_zombies.end())
+        {
+            Retire(std::move(it->second));
+            m_zombies.erase(it);
+        }
+    }
+}
+
+void UringReactor::OnArm(UringEntry *e, const struct io_uring_cqe &cqe)
+{
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+    {
+        // multishot ended, re-armed below if it should go on
+        e->armed = false;
+        --e->ops;
+    }
+
+    int res = cqe.res;
+    bool rearm = (res >= 0 || res == -ECANCELED);
+
+    switch (e->kind)
+    {
+    case LISTENER:
+        if (res < 0)
+        {
+            if (res != -ECANCELED &&
+                res != -ECONNABORTED &&
+                !e->dead)
+            {
+                e->h->OnError(-res);
+            }
+
+            break;
+        }
+
+        if (e->dead)
+            close(res);
+        else
+            e->h->OnAccept(res);
+
+        break;
+
+    case STREAM:
+    {
+        bool buffered = (cqe.flags & IORING_CQE_F_BUFFER);
+        uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+
+        // out of buffers, picks up once they come back
+        rearm = (res > 0 || res == -ENOBUFS || res == -ECANCELED);
+
+        if (!e->dead)
+        {
+            if (res > 0)
+            {
+                e->h->OnRecv(m_bufs + (size_t) bid * BUF_SIZE, res);
+            }
+            else if (res == 0)
+            {
+                e->h->OnRecv(NULL, 0);
+            }
+            else if (res != -ENOBUFS &&
+                     res != -ECANCELED)
+            {
+                errno = -res;
+                e->h->OnRecv(NULL, -1);
+            }
+        }
+
+        if (buffered)
+            Recycle(bid);
+
+        break;
+    }
+
+    case WATCH:
+        if (res > 0 && !e->dead)
+            e->h->OnReadable();
+
+        break;
+    }
+
+    if (!rearm &&
+        e->kind != STREAM &&
+        !e->dead)
+    {
+        // e.g. out of fds, try again later rather than spin
+        int fd = e->fd;
+
+        AddTimer(100, [this, fd]
+        {
+            auto *e = static_cast<UringEntry*>(Find(fd));
+
+            if (e && !e->armed && !e->paused)
+                Arm(e);
+        });
+
+        return;
+    }
+
+    if (rearm &&
+        !e->dead &&
+        !e->armed &&
+        !e->paused)
+    {
+        Arm(e);
+    }
+}
+
+void UringReactor::OnSend(UringEntry *e, const struct io_uring_cqe &cqe)
+{
+    --e->ops;
+
+    e->sending = false;
+    e->hold.reset();
+
+    if (e->dead)
+        return;
+
+    if (cqe.res < 0)
+    {
+        e->h->OnError(-cqe.res);
+        return;
+    }
+
+    // reported once out, so watermarks and traces see it leave
+    e->h->OnSent(cqe.res);
+
+    // closed from OnSent, e itself lives to the end of the round
+    if (e->dead)
+        return;
+
+    // the rest after a short send, or what came meanwhile
+    Pull(e);
+}
+
+OOLONG_NS_END
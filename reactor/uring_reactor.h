@@ -0,0 +1,155 @@
+#ifndef OOLONG_URING_REACTOR_H
+#define OOLONG_URING_REACTOR_H
+
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include "reactor.h"
+
+OOLONG_NS_BEGIN
+
+// completion reactor on io_uring, driven through the raw syscalls.
+// listeners use multishot accept, streams a multishot recv into a ring
+// of provided buffers, and output goes out as one sendmsg at a time.
+class UringReactor : public Reactor
+{
+public:
+    UringReactor();
+    virtual ~UringReactor();
+
+    Backend Type() const override;
+
+    int AddListener(int fd, Handler *h) override;
+
+    int AddStream(int fd, Handler *h) override;
+
+    int AddWatch(int fd, Handler *h) override;
+
+    int Remove(int fd) override;
+
+    int EnableRead(int fd, bool on) override;
+
+    int WantWrite(int fd) override;
+
+protected:
+    int Init() override;
+
+    void Poll(long timeout) override;
+
+private:
+    enum
+    {
+        SQ_ENTRIES = 256,
+
+        // provided receive buffers, count is a power of two
+        BUF_GROUP = 0,
+        BUF_COUNT = 256,
+        BUF_SIZE = 16 * 1024,
+
+        // iovecs per sendmsg
+        MAX_SENDS = 16,
+    };
+
+    enum Op
+    {
+        OP_ARM = 1,
+        OP_SEND = 2,
+    };
+
+    struct UringEntry : public Entry
+    {
+        UringEntry(int f, Kind k, Handler *handler)
+            : Entry(f, k, handler),
+              ops(0),
+              armed(false),
+              paused(false),
+              want_write(false),
+              sending(false)
+        {
+        }
+
+        // submitted ops still owed a final completion
+        int ops;
+
+        // multishot accept, recv or poll in flight
+        bool armed;
+        bool paused;
+
+        // handler has output we haven't taken yet
+        bool want_write;
+
+        // a sendmsg in flight over iov, the handler's bytes held by
+        // hold, or copied into copy
+        bool sending;
+        struct iovec iov[MAX_SENDS];
+        struct msghdr msg;
+        std::shared_ptr<void> hold;
+        std::string copy;
+    };
+
+    int Add(int fd, Kind kind, Handler *h);
+
+    struct io_uring_sqe* GetSqe();
+
+    unsigned SqSpace() const;
+
+    // hand queued sqes to the kernel, optionally wait for one cqe
+    int Submit(unsigned wait, long timeout);
+
+    int Arm(UringEntry *e);
+
+    void Cancel(UringEntry *e);
+
+    // take the handler's output and send it
+    void Pull(UringEntry *e);
+
+    void Complete(const struct io_uring_cqe &cqe);
+
+    void OnArm(UringEntry *e, const struct io_uring_cqe &cqe);
+
+    void OnSend(UringEntry *e, const struct io_uring_cqe &cqe);
+
+    // give a receive buffer back to the kernel
+    void Recycle(uint16_t bid);
+
+    int m_ring_fd;
+
+    void *m_sq_ptr;
+    size_t m_sq_size;
+
+    void *m_cq_ptr;
+    size_t m_cq_size;
+
+    struct io_uring_sqe *m_sqes;
+    size_t m_sqes_size;
+
+    unsigned *m_sq_head;
+    unsigned *m_sq_tail;
+    unsigned *m_sq_array;
+    unsigned m_sq_mask;
+    unsigned m_sq_entries;
+
+    // sqes filled in, and handed to the kernel
+    unsigned m_sq_pending;
+    unsigned m_sq_flushed;
+
+    unsigned *m_cq_head;
+    unsigned *m_cq_tail;
+    unsigned m_cq_mask;
+    struct io_uring_cqe *m_cqes;
+
+    struct io_uring_buf_ring *m_buf_ring;
+    size_t m_buf_ring_size;
+    char *m_bufs;
+    uint16_t m_buf_tail;
+
+    // streams with output to pick up
+    std::vector<int> m_want;
+
+    // removed, waiting for their last completions
+    std::unordered_map<Entry*, std::unique_ptr<Entry>> m_zombies;
+};
+
+OOLONG_NS_END
+
+#endif
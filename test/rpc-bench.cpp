@@ -0,0 +1,936 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+#include "json-rpc/rpc_server.h"
+#include "json-rpc/rpc_client.h"
+#include "json-rpc/rpc_pool.h"
+#include "json-rpc/unix_addr.h"
+#include "reactor/memory_reactor.h"
+
+struct Result
+{
+    std::vector<long> lat; // nanosec
+    int errors = 0;
+};
+
+static long NowNS()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ts.tv_sec * 1000000000L) + ts.tv_nsec;
+}
+
+int Echo(const nlohmann::json &params, nlohmann::json &res)
+{
+    res = params;
+    return 0;
+}
+
+// holds a worker for params.us microsec
+int Work(const nlohmann::json &params, nlohmann::json &res)
+{
+    usleep(params.value("us", 0L));
+
+    res = true;
+    return 0;
+}
+
+static std::string Frame(const char *method, const nlohmann::json &params)
+{
+    nlohmann::json req = {
+        { "jsonrpc", "2.0" },
+        { "method", method },
+        { "params", params },
+        { "id", 1 },
+    };
+
+    std::string s = req.dump();
+    uint16_t datalen = htons(s.size());
+
+    s.insert(0, (char*) &datalen, 2);
+    return s;
+}
+
+// one connection keeping depth work requests in flight, for the rest
+// of the run
+static void Flood(const std::string &path, int depth, long us)
+{
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (sock < 0 ||
+        oolong::MakeUnixAddr(path, &addr, &addrlen) < 0 ||
+        connect(sock, (struct sockaddr*) &addr, addrlen) < 0)
+    {
+        printf("flood: %s\n", strerror(errno));
+        return;
+    }
+
+    std::thread([sock, depth, us]
+    {
+        std::string frame = Frame("work", { { "us", us } });
+        std::string out, in;
+        char buf[65536];
+
+        for (int i = 0; i < depth; ++i)
+            out += frame;
+
+        for (;;)
+        {
+            if (!out.empty() &&
+                send(sock, out.data(), out.size(), MSG_NOSIGNAL) < 0)
+            {
+                return;
+            }
+
+            out.clear();
+
+            ssize_t n = recv(sock, buf, sizeof(buf), 0);
+
+            if (n <= 0)
+                return;
+
+            in.append(buf, n);
+
+            // a new request for each reply
+            while (in.size() >= 2)
+            {
+                size_t len = ntohs(*(uint16_t*) in.data()) + 2;
+
+                if (in.size() < len)
+                    break;
+
+                in.erase(0, len);
+                out += frame;
+            }
+        }
+    }).detach();
+}
+
+static int Connect(oolong::RPCClient &c,
+                   const std::string &transport,
+                   int port,
+                   const std::string &path)
+{
+    if (transport == "unix")
+        return c.ConnectUnix(path.c_str());
+
+    if (transport == "shm")
+        return c.ConnectShm(path.c_str());
+
+    return c.ConnectTCP("127.0.0.1", port);
+}
+
+static void Report(const std::string &transport,
+                   int clients,
+                   const std::vector<Result> &results,
+                   long elapsed)
+{
+    std::vector<long> all;
+    int errors = 0;
+
+    for (auto &r : results)
+    {
+        all.insert(all.end(), r.lat.begin(), r.lat.end());
+        errors += r.errors;
+    }
+
+    std::sort(all.begin(), all.end());
+
+    auto pct = [&all](double p) -> double
+    {
+        if (all.empty())
+            return 0;
+
+        return all[(size_t) (p * (all.size() - 1))] / 1000.0;
+    };
+
+    printf("%-6s clients=%-4d reqs=%-8zu errors=%-4d "
+           "rps=%-10.0f p50=%.1fus p99=%.1fus max=%.1fus\n",
+           transport.c_str(),
+           clients,
+           all.size(),
+           errors,
+           all.size() / (elapsed / 1e9),
+           pct(0.5),
+           pct(0.99),
+           pct(1.0));
+}
+
+static void Run(const std::string &transport,
+                int clients,
+                int requests,
+                int port,
+                const std::string &path,
+                const std::string &label = "")
+{
+    std::vector<Result> results(clients);
+    std::vector<std::thread> threads;
+
+    long start = NowNS();
+
+    for (int i = 0; i < clients; ++i)
+    {
+        threads.emplace_back([&, i]
+        {
+            auto &r = results[i];
+            oolong::RPCClient c;
+
+            if (Connect(c, transport, port, path) < 0)
+            {
+                r.errors = requests;
+                return;
+            }
+
+            nlohmann::json param = { { "n", i } };
+
+            r.lat.reserve(requests);
+
+            for (int n = 0; n < requests; ++n)
+            {
+                long t0 = NowNS();
+
+                if (c.Send("echo", param) < 0 ||
+                    c.Recv(1000) < 0)
+                {
+                    ++r.errors;
+                    continue;
+                }
+
+                r.lat.push_back(NowNS() - t0);
+            }
+        });
+    }
+
+    for (auto &t : threads)
+        t.join();
+
+    Report(label.empty() ? transport : label,
+           clients,
+           results,
+           NowNS() - start);
+}
+
+// the clients are threads sharing one connection, their calls are
+// batched into common writes
+static void RunBatched(int clients,
+                       int requests,
+                       const std::string &path,
+                       long window)
+{
+    std::vector<Result> results(clients);
+    std::vector<std::thread> threads;
+
+    oolong::RPCClient c;
+
+    if (c.ConnectUnix(path.c_str()) < 0 ||
+        c.StartBatching(window, clients) < 0)
+    {
+        printf("batch: %s\n", strerror(errno));
+        return;
+    }
+
+    long start = NowNS();
+
+    for (int i = 0; i < clients; ++i)
+    {
+        threads.emplace_back([&, i]
+        {
+            auto &r = results[i];
+            nlohmann::json param = { { "n", i } };
+            nlohmann::json resp;
+
+            r.lat.reserve(requests);
+
+            for (int n = 0; n < requests; ++n)
+            {
+                long t0 = NowNS();
+
+                if (c.Call("echo", param, resp, 1000) < 0 ||
+                    resp["result"] != param)
+                {
+                    ++r.errors;
+                    continue;
+                }
+
+                r.lat.push_back(NowNS() - t0);
+            }
+        });
+    }
+
+    for (auto &t : threads)
+        t.join();
+
+    Report("batch", clients, results, NowNS() - start);
+}
+
+// a tcp port relayed to the server's unix socket, which can be taken
+// down and brought back up, for the pool to back off and reconnect
+class Relay
+{
+public:
+    Relay(int port, const std::string &path)
+        : m_port(port),
+          m_path(path),
+          m_listen(-1),
+          m_accepted(0)
+    {
+    }
+
+    int Up()
+    {
+        struct sockaddr_in addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(m_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        int opt = 1;
+
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+            listen(sock, SOMAXCONN) < 0)
+        {
+            close(sock);
+            return -1;
+        }
+
+        m_listen = sock;
+
+        std::thread([this, sock]
+        {
+            int fd;
+
+            while ((fd = accept(sock, NULL, NULL)) >= 0)
+            {
+                struct sockaddr_un addr;
+                socklen_t addrlen;
+
+                int peer = socket(AF_UNIX, SOCK_STREAM, 0);
+
+                if (oolong::MakeUnixAddr(m_path, &addr, &addrlen) < 0 ||
+                    connect(peer, (struct sockaddr*) &addr, addrlen) < 0)
+                {
+                    close(peer);
+                    close(fd);
+                    continue;
+                }
+
+                {
+                    std::unique_lock<std::mutex>
+                        lock(m_lock);
+
+                    m_fds.push_back(fd);
+                    m_fds.push_back(peer);
+                }
+
+                ++m_accepted;
+
+                std::thread([fd, peer] { Pipe(fd, peer); }).detach();
+            }
+
+            close(sock);
+        }).detach();
+
+        return 0;
+    }
+
+    // refuse new connections and reset the relayed ones
+    void Down()
+    {
+        shutdown(m_listen, SHUT_RDWR);
+
+        std::unique_lock<std::mutex>
+            lock(m_lock);
+
+        for (int fd : m_fds)
+            shutdown(fd, SHUT_RDWR);
+
+        m_fds.clear();
+    }
+
+    int Accepted() const
+    {
+        return m_accepted;
+    }
+
+private:
+    static void Pipe(int a, int b)
+    {
+        struct pollfd pfd[2] = { { a, POLLIN, 0 }, { b, POLLIN, 0 } };
+        char buf[65536];
+
+        while (poll(pfd, 2, -1) > 0)
+        {
+            int from = (pfd[0].revents) ? 0 : 1;
+            ssize_t n = recv(pfd[from].fd, buf, sizeof(buf), 0);
+
+            if (n <= 0 ||
+                send(pfd[!from].fd, buf, n, MSG_NOSIGNAL) != n)
+            {
+                break;
+            }
+        }
+
+        // shutdown by Down() leaves the closing to us
+        close(a);
+        close(b);
+    }
+
+    int m_port;
+    std::string m_path;
+    int m_listen;
+    std::atomic<int> m_accepted;
+
+    std::mutex m_lock;
+    std::vector<int> m_fds;
+};
+
+// the clients lease connections from a pool over the tcp port and a
+// relay, which goes down for the middle third of the run
+static void RunPool(int clients,
+                    int requests,
+                    int port,
+                    const std::string &path)
+{
+    Relay relay(port + 100, path);
+
+    if (relay.Up() < 0)
+    {
+        printf("pool: relay: %s\n", strerror(errno));
+        return;
+    }
+
+    oolong::RPCClientPool::Options opt;
+
+    opt.backoff_min = 10;
+    opt.backoff_max = 100;
+
+    oolong::RPCClientPool pool(opt);
+
+    pool.AddEndpoint("127.0.0.1", port);
+    pool.AddEndpoint("localhost", port + 100);
+
+    std::vector<Result> results(clients);
+    std::vector<std::thread> threads;
+    std::atomic<long> done(0);
+
+    long total = (long) clients * requests;
+    long start = NowNS();
+
+    for (int i = 0; i < clients; ++i)
+    {
+        threads.emplace_back([&, i]
+        {
+            auto &r = results[i];
+            nlohmann::json param = { { "n", i } };
+
+            r.lat.reserve(requests);
+
+            for (int n = 0; n < requests; ++n, ++done)
+            {
+                long t0 = NowNS();
+                auto c = pool.Get();
+
+                if (c.Send("echo", param) < 0 ||
+                    c.Recv(1000) < 0)
+                {
+                    ++r.errors;
+                    continue;
+                }
+
+                r.lat.push_back(NowNS() - t0);
+            }
+        });
+    }
+
+    int before = 0;
+
+    while (done < total / 3)
+        usleep(1000);
+
+    before = relay.Accepted();
+    relay.Down();
+
+    while (done < total * 2 / 3)
+        usleep(1000);
+
+    int rc = relay.Up();
+
+    for (auto &t : threads)
+        t.join();
+
+    Report("pool", clients, results, NowNS() - start);
+
+    printf("pool relay conns before=%d after=%d%s\n",
+           before,
+           relay.Accepted() - before,
+           (rc < 0) ? " (relay failed to come back)" : "");
+}
+
+static std::atomic<long> s_ingested(0);
+
+// counts what the batches deliver
+static void Ingest(std::vector<nlohmann::json> &params)
+{
+    s_ingested += params.size();
+}
+
+// fire and forget notifications from each client, as fast as the
+// sockets take them, until the batches delivered all of them. written
+// by a flusher thread if linger >= 0
+static void RunIngest(const std::string &path,
+                      int clients,
+                      int events,
+                      long linger)
+{
+    std::vector<std::thread> threads;
+    std::atomic<int> errors(0);
+
+    long start = NowNS();
+
+    for (int i = 0; i < clients; ++i)
+    {
+        threads.emplace_back([&, i]
+        {
+            oolong::RPCClient c;
+
+            if (c.ConnectUnix(path.c_str()) < 0 ||
+                (linger >= 0 && c.StartFlusher(linger) < 0))
+            {
+                errors += events;
+                return;
+            }
+
+            nlohmann::json param = { { "n", i } };
+
+            for (int sent = 0; sent < events; )
+            {
+                if (c.Notify("ingest", param) == 0)
+                {
+                    ++sent;
+                    continue;
+                }
+
+                // the flusher is behind
+                if (errno == EAGAIN)
+                {
+                    usleep(10);
+                    continue;
+                }
+
+                errors += events - sent;
+                break;
+            }
+
+            // the server must not have closed on any of them
+            if (c.Flush() < 0)
+                ++errors;
+        });
+    }
+
+    for (auto &t : threads)
+        t.join();
+
+    long total = (long) clients * events - errors;
+
+    for (int i = 0; i < 5000 && s_ingested < total; ++i)
+        usleep(1000);
+
+    long elapsed = NowNS() - start;
+
+    printf("ingest clients=%-4d events=%-8ld delivered=%-8ld errors=%-4d "
+           "eps=%.0f\n",
+           clients,
+           total,
+           s_ingested.load(),
+           errors.load(),
+           s_ingested / (elapsed / 1e9));
+}
+
+struct Profile
+{
+    const char *name;
+    oolong::JSONRPCServer::SocketOptions opts;
+};
+
+// socket option sets swept with -s, each gets its own tcp port
+static std::vector<Profile> Profiles()
+{
+    std::vector<Profile> v;
+    Profile p;
+
+    p = Profile { "nagle", {} };
+    p.opts.nodelay = false;
+    v.push_back(p);
+
+    p = Profile { "buf64k", {} };
+    p.opts.sndbuf = p.opts.rcvbuf = 64 * 1024;
+    v.push_back(p);
+
+    p = Profile { "buf1m", {} };
+    p.opts.sndbuf = p.opts.rcvbuf = 1024 * 1024;
+    v.push_back(p);
+
+    p = Profile { "defer", {} };
+    p.opts.defer_accept = 1;
+    v.push_back(p);
+
+    p = Profile { "tfo", {} };
+    p.opts.fastopen = 64;
+    v.push_back(p);
+
+    p = Profile { "bpoll", {} };
+    p.opts.busy_poll = 50;
+    v.push_back(p);
+
+    p = Profile { "utmo", {} };
+    p.opts.user_timeout = 5000;
+    v.push_back(p);
+
+    return v;
+}
+
+// closed loop of in-memory connections, all on the server's loop
+// thread, measures the server without the kernel's socket path
+static void RunMemory(oolong::JSONRPCServer &s, int clients, int requests)
+{
+    struct Conn
+    {
+        int fd = -1;
+        int left = 0;
+        long t0 = 0;
+        std::string in;
+        std::string frame;
+    };
+
+    auto *r = static_cast<oolong::MemoryReactor*>(s.GetReactor());
+
+    std::vector<Result> results(clients);
+    std::vector<Conn> conns(clients);
+    std::promise<void> done;
+    int running = clients;
+
+    auto finish = [&](int i)
+    {
+        if (conns[i].left < 0)
+            return;
+
+        results[i].errors += conns[i].left;
+        conns[i].left = -1;
+
+        if (--running == 0)
+            done.set_value();
+    };
+
+    long start = NowNS();
+
+    r->Post([&]
+    {
+        for (int i = 0; i < clients; ++i)
+        {
+            auto &c = conns[i];
+
+            c.left = requests;
+            c.frame = Frame("echo", { { "n", i } });
+            results[i].lat.reserve(requests);
+
+            c.fd = r->Connect([&, i](const char *data, size_t n)
+            {
+                auto &c = conns[i];
+
+                if (!data)
+                {
+                    finish(i);
+                    return;
+                }
+
+                c.in.append(data, n);
+
+                while (c.in.size() >= 2)
+                {
+                    size_t len = ntohs(*(uint16_t*) c.in.data()) + 2;
+
+                    if (c.in.size() < len)
+                        break;
+
+                    c.in.erase(0, len);
+                    results[i].lat.push_back(NowNS() - c.t0);
+
+                    if (--c.left == 0)
+                    {
+                        finish(i);
+                        return;
+                    }
+
+                    c.t0 = NowNS();
+                    r->Inject(c.fd, c.frame.data(), c.frame.size());
+                }
+            });
+
+            if (c.fd < 0)
+            {
+                finish(i);
+                continue;
+            }
+
+            c.t0 = NowNS();
+            r->Inject(c.fd, c.frame.data(), c.frame.size());
+        }
+    });
+
+    done.get_future().wait();
+
+    Report("memory", clients, results, NowNS() - start);
+}
+
+int main(int argc, char *argv[])
+{
+    int clients = 4;
+    int requests = 10000;
+    int workers = 4;
+    int port = 8899;
+    std::string path = "@oolong-bench";
+    std::string transport = "all";
+    int flags = 0;
+    int backlog = SOMAXCONN;
+    bool sweep = false;
+    int flood = 0;
+    long flood_us = 200;
+    int max_inflight = 0;
+    int batch = 0;
+    long cache_ttl = 0;
+    unsigned trace = 0;
+    int ingest = 0;
+    long linger = -1;
+    long window = -1;
+    bool pooled = false;
+    auto backend = oolong::Reactor::LIBEVENT;
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:w:p:u:t:ir:b:sf:F:m:HB:C:T:N:L:A:P")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c': clients = atoi(optarg); break;
+        case 'n': requests = atoi(optarg); break;
+        case 'w': workers = atoi(optarg); break;
+        case 'p': port = atoi(optarg); break;
+        case 'u': path = optarg; break;
+        case 't': transport = optarg; break;
+        case 'i': flags |= oolong::JSONRPCServer::METHOD_INLINE; break;
+        case 'b': backlog = atoi(optarg); break;
+        case 's': sweep = true; break;
+        case 'f': flood = atoi(optarg); break;
+        case 'F': flood_us = atol(optarg); break;
+        case 'm': max_inflight = atoi(optarg); break;
+        case 'H': flags |= oolong::JSONRPCServer::METHOD_HIGH; break;
+        case 'B': batch = atoi(optarg); break;
+        case 'C': cache_ttl = atol(optarg); break;
+        case 'T': trace = atoi(optarg); break;
+        case 'N': ingest = atoi(optarg); break;
+        case 'L': linger = atol(optarg); break;
+        case 'A': window = atol(optarg); break;
+        case 'P': pooled = true; break;
+        case 'r':
+            if (oolong::Reactor::Parse(optarg, &backend) == 0)
+                break;
+            // fall through
+        default:
+            printf("%s [-c clients] [-n requests] [-w workers] "
+                   "[-p port] [-u unix path] [-t tcp|unix|shm|all] "
+                   "[-i (inline echo)] [-b backlog] "
+                   "[-s (sweep tcp socket options)] "
+                   "[-f flood depth] [-F flood work usec] "
+                   "[-m max inflight per client] "
+                   "[-H (echo in the high lane)] "
+                   "[-B batch pool threads for work] "
+                   "[-N notifications per client, batched] "
+                   "[-L flusher linger usec for -N] "
+                   "[-A batching window usec, clients share a connection] "
+                   "[-P (client pool over tcp and a relay on port + 100)] "
+                   "[-r libevent|io_uring|epoll|memory]\n",
+                   argv[0]);
+            return -1;
+        }
+    }
+
+    auto &s = oolong::JSONRPCServer::Instance();
+
+    if (s.BindTCP(port) < 0 ||
+        s.BindUnix(path) < 0)
+    {
+        printf("bind failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // the profiles listen on port + 1, port + 2, ...
+    std::vector<std::pair<std::string, int>> swept;
+
+    if (sweep)
+    {
+        int n = 0;
+
+        for (auto &p : Profiles())
+        {
+            ++n;
+
+            if (s.BindTCP(port + n, p.opts) < 0)
+            {
+                printf("%s skipped: %s\n", p.name, strerror(errno));
+                continue;
+            }
+
+            swept.emplace_back(p.name, port + n);
+        }
+    }
+
+    s.SetTracing(trace);
+    s.SetBacklog(backlog);
+    s.SetMaxInflight(max_inflight);
+    s.EnableShm();
+    s.AddMethod("echo", "echo", Echo, flags, "", cache_ttl);
+    // work on a pool of its own, or next to echo
+    if (batch > 0)
+        s.AddPool("batch", batch);
+
+    s.AddMethod("work", "work", Work, 0, batch > 0 ? "batch" : "");
+    s.AddBatchMethod("ingest", "ingest", Ingest);
+
+    std::thread server([&s, workers, backend]
+    {
+        s.StartListen(workers, backend);
+    });
+
+    server.detach();
+
+    // let the loop come up
+    usleep(100000);
+
+    printf("reactor %s\n", oolong::Reactor::Name(s.Backend()));
+
+    // a heavy client next to the measured ones
+    if (flood > 0)
+        Flood(path, flood, flood_us);
+
+    // nothing listens on the real sockets
+    if (s.Backend() == oolong::Reactor::MEMORY)
+        transport = "memory";
+
+    if (transport == "memory")
+        RunMemory(s, clients, requests);
+
+    if (transport == "tcp" || transport == "all")
+        Run("tcp", clients, requests, port, path);
+
+    if (transport != "memory")
+    {
+        for (auto &p : swept)
+            Run("tcp", clients, requests, p.second, path, p.first);
+    }
+
+    if (transport == "unix" || transport == "all")
+        Run("unix", clients, requests, port, path);
+
+    if (transport == "shm" || transport == "all")
+        Run("shm", clients, requests, port, path);
+
+    if (pooled &&
+        transport != "memory")
+    {
+        RunPool(clients, requests, port, path);
+    }
+
+    if (window >= 0 &&
+        transport != "memory")
+    {
+        RunBatched(clients, requests, path, window);
+    }
+
+    if (ingest > 0 &&
+        transport != "memory")
+    {
+        RunIngest(path, clients, ingest, linger);
+    }
+
+    auto &m = s.GetMetrics();
+
+    printf("inline calls=%lu slow=%lu max=%luus\n",
+           (unsigned long) m.inline_calls,
+           (unsigned long) m.inline_slow,
+           (unsigned long) m.inline_max_us);
+
+    if (trace)
+    {
+        const char *file = "rpc-bench.trace.json";
+
+        if (s.DumpTrace(file) == 0)
+            printf("trace of 1 in %u requests in %s\n", trace, file);
+    }
+
+    if (ingest > 0)
+    {
+        printf("batched=%lu batches=%lu\n",
+               (unsigned long) m.batched,
+               (unsigned long) m.batches);
+    }
+
+    if (cache_ttl)
+    {
+        printf("cache hits=%lu misses=%lu\n",
+               (unsigned long) m.cache_hits,
+               (unsigned long) m.cache_misses);
+    }
+
+    // highest lag bucket that saw one in a hundred probes
+    uint64_t probes = 0;
+
+    for (auto &b : m.loop_lag)
+        probes += b;
+
+    int p99 = 0;
+
+    for (uint64_t seen = 0; p99 < m.LAG_BUCKETS; ++p99)
+    {
+        seen += m.loop_lag[p99];
+
+        if (seen * 100 >= probes * 99)
+            break;
+    }
+
+    printf("loop lag p99<%luus max=%luus stalls=%lu\n",
+           2UL << p99,
+           (unsigned long) m.loop_lag_max_us,
+           (unsigned long) m.loop_stalls);
+
+    printf("accept conns=%lu errors=%lu queue_max=%lu overflows=%lu\n",
+           (unsigned long) m.accepted,
+           (unsigned long) m.accept_errors,
+           (unsigned long) m.accept_queue_max,
+           (unsigned long) m.accept_overflows);
+
+    fflush(stdout);
+
+    // the server thread is parked in its event loop
+    _exit(0);
+}
@@ -0,0 +1,360 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <string>
+#include <thread>
+
+#include "json-rpc/rpc_server.h"
+#include "json-rpc/rpc_client.h"
+#include "json-rpc/unix_addr.h"
+
+// edge cases a peer can drive the server into, one connection each.
+// exits with the number of failed checks
+
+static std::string s_path;
+static int s_failed = 0;
+
+static void Check(const char *name, bool ok)
+{
+    printf("%-48s %s\n", name, ok ? "ok" : "FAILED");
+
+    if (!ok)
+        ++s_failed;
+}
+
+static int Connect()
+{
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (sock < 0 ||
+        oolong::MakeUnixAddr(s_path, &addr, &addrlen) < 0 ||
+        connect(sock, (struct sockaddr*) &addr, addrlen) < 0)
+    {
+        if (sock >= 0)
+            close(sock);
+
+        return -1;
+    }
+
+    return sock;
+}
+
+static bool SendFrame(int sock, const std::string &payload)
+{
+    uint16_t datalen = htons(payload.size());
+    std::string s((char*) &datalen, 2);
+
+    s += payload;
+
+    return (send(sock, s.data(), s.size(), MSG_NOSIGNAL) == (ssize_t) s.size());
+}
+
+// next frame's payload, null on timeout or close
+static nlohmann::json RecvFrame(int sock, long timeout = 1000)
+{
+    std::string in;
+
+    while (in.size() < 2 ||
+           in.size() < (size_t) ntohs(*(uint16_t*) in.data()) + 2)
+    {
+        struct pollfd pfd = { sock, POLLIN, 0 };
+
+        if (poll(&pfd, 1, timeout) <= 0)
+            return nullptr;
+
+        char buf[65536];
+        ssize_t n = recv(sock, buf, sizeof(buf), 0);
+
+        if (n <= 0)
+            return nullptr;
+
+        in.append(buf, n);
+    }
+
+    return nlohmann::json::parse(in.substr(2, ntohs(*(uint16_t*) in.data())),
+                                 nullptr,
+                                 false);
+}
+
+static int ErrorCode(const nlohmann::json &r)
+{
+    if (!r.is_object() || !r.count("error"))
+        return 0;
+
+    return r["error"].value("code", 0);
+}
+
+static nlohmann::json Request(const nlohmann::json &id,
+                              const char *method,
+                              const nlohmann::json &params = nullptr)
+{
+    nlohmann::json req = {
+        { "jsonrpc", "2.0" },
+        { "method", method },
+        { "id", id },
+    };
+
+    if (!params.is_null())
+        req["params"] = params;
+
+    return req;
+}
+
+// the connection still answers
+static bool Alive(int sock)
+{
+    if (!SendFrame(sock, Request(7, "echo", 1).dump()))
+        return false;
+
+    auto r = RecvFrame(sock);
+
+    return (r.is_object() && r.value("result", 0) == 1);
+}
+
+static void HugeId()
+{
+    int sock = Connect();
+
+    // an error echoing it would not fit in a frame
+    std::string id(65490, 'A');
+
+    SendFrame(sock, Request(id, "nosuch").dump());
+
+    auto r = RecvFrame(sock);
+
+    Check("huge id is refused",
+          ErrorCode(r) == -32600 && r["id"].is_null());
+
+    Check("huge id keeps the connection", Alive(sock));
+
+    close(sock);
+}
+
+static void LargeResult(const char *method)
+{
+    int sock = Connect();
+    std::string name = method;
+
+    // fits alone, not with the envelope around it
+    SendFrame(sock, Request(1, method, 65530).dump());
+
+    auto r = RecvFrame(sock);
+
+    Check((name + ": result over a frame is an error").c_str(),
+          ErrorCode(r) == -32603 && r["id"] == 1);
+
+    SendFrame(sock, Request(2, method, 1000).dump());
+
+    r = RecvFrame(sock);
+
+    Check((name + ": result under a frame is sent").c_str(),
+          r.is_object() && r.value("result", "").size() == 1000);
+
+    close(sock);
+}
+
+static void Pipelined()
+{
+    int sock = Connect();
+    std::string s;
+
+    // many frames, one write
+    for (int i = 0; i < 1000; ++i)
+    {
+        std::string req = Request(i, "echo", i).dump();
+        uint16_t datalen = htons(req.size());
+
+        s.append((char*) &datalen, 2);
+        s += req;
+    }
+
+    send(sock, s.data(), s.size(), MSG_NOSIGNAL);
+
+    // replies come back to back too, RecvFrame() would drop the rest
+    std::string in;
+    size_t pos = 0;
+    int answered = 0;
+
+    while (answered < 1000)
+    {
+        if (in.size() - pos >= 2)
+        {
+            size_t datalen = ntohs(*(uint16_t*) (in.data() + pos));
+
+            if (in.size() - pos >= datalen + 2)
+            {
+                auto r = nlohmann::json::parse(in.substr(pos + 2, datalen),
+                                               nullptr,
+                                               false);
+
+                if (!r.is_object() || r["id"] != r["result"])
+                    break;
+
+                ++answered;
+                pos += datalen + 2;
+                continue;
+            }
+        }
+
+        struct pollfd pfd = { sock, POLLIN, 0 };
+
+        if (poll(&pfd, 1, 1000) <= 0)
+            break;
+
+        char buf[65536];
+        ssize_t n = recv(sock, buf, sizeof(buf), 0);
+
+        if (n <= 0)
+            break;
+
+        in.append(buf, n);
+    }
+
+    Check("pipelined frames are all answered", answered == 1000);
+
+    close(sock);
+}
+
+static void FalseSchema()
+{
+    int sock = Connect();
+
+    SendFrame(sock, Request(1, "never", 1).dump());
+
+    Check("false schema refuses params",
+          ErrorCode(RecvFrame(sock)) == -32602);
+
+    SendFrame(sock, Request(2, "nodebug", { { "debug", 1 } }).dump());
+
+    Check("false property schema refuses it",
+          ErrorCode(RecvFrame(sock)) == -32602);
+
+    SendFrame(sock, Request(3, "nodebug", { { "x", 1 } }).dump());
+
+    auto r = RecvFrame(sock);
+
+    Check("false property schema takes the rest",
+          r.is_object() && r.count("result"));
+
+    close(sock);
+}
+
+static void LargeRequest()
+{
+    oolong::RPCClient c;
+
+    c.ConnectUnix(s_path.c_str());
+
+    nlohmann::json big = std::string(65536, 'x');
+    int rc = c.Notify("echo", big);
+
+    Check("notify over a frame is EMSGSIZE", rc < 0 && errno == EMSGSIZE);
+
+    rc = c.Send("echo", big, 3);
+
+    Check("send over a frame is EMSGSIZE", rc < 0 && errno == EMSGSIZE);
+
+    nlohmann::json small = 1;
+
+    nlohmann::json r;
+
+    if (c.Send("echo", small, 4) > 0 &&
+        c.Recv(1000) == 0)
+        r = nlohmann::json::parse(std::string(c.Data(), c.DataLength()),
+                                  nullptr,
+                                  false);
+
+    Check("send under a frame still works",
+          r.is_object() && r.value("id", 0) == 4);
+}
+
+static void Batching()
+{
+    oolong::RPCClient c;
+
+    c.ConnectUnix(s_path.c_str());
+    c.StartBatching();
+
+    nlohmann::json r;
+    int rc = c.Call("echo", std::string(65536, 'x'), r, 1000);
+
+    Check("call over a frame is EMSGSIZE", rc < 0 && errno == EMSGSIZE);
+
+    Check("call under a frame still works",
+          c.Call("echo", 1, r, 1000) == 0 && r.value("result", 0) == 1);
+
+    c.StopBatching();
+
+    // stopped with batching, it started it
+    Check("batching stops its own flusher", c.StartFlusher() == 0);
+
+    c.StartBatching();
+    c.StopBatching();
+
+    rc = c.StartFlusher();
+
+    Check("batching leaves a flusher it found", rc < 0 && errno == EEXIST);
+
+    c.StopFlusher();
+}
+
+int Echo(const nlohmann::json &params, nlohmann::json &res)
+{
+    res = params;
+    return 0;
+}
+
+// a string of params bytes
+int Blob(const nlohmann::json &params, nlohmann::json &res)
+{
+    res = std::string(params.get<size_t>(), 'x');
+    return 0;
+}
+
+int main()
+{
+    auto &s = oolong::JSONRPCServer::Instance();
+
+    s_path = "@rpc-check-" + std::to_string(getpid());
+
+    if (s.BindUnix(s_path) < 0)
+    {
+        printf("bind failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    s.AddMethod("echo", "echo", Echo);
+    s.AddMethod("blob", "a string of params bytes", Blob);
+
+    // replied from the serialized result
+    s.AddMethod("cached-blob", "blob, cached", Blob, 0, "", 1000);
+
+    s.AddMethod("never", "echo, takes no params", Echo);
+    s.SetSchema("never", false);
+
+    s.AddMethod("nodebug", "echo, without debug", Echo);
+    s.SetSchema("nodebug", { { "properties", { { "debug", false } } } });
+
+    std::thread([&s] { s.StartListen(2); }).detach();
+
+    // let the loop come up
+    usleep(100000);
+
+    HugeId();
+    LargeResult("blob");
+    LargeResult("cached-blob");
+    Pipelined();
+    FalseSchema();
+    LargeRequest();
+    Batching();
+
+    fflush(stdout);
+
+    // the server thread is parked in its event loop
+    _exit(s_failed);
+}
@@ -1,4 +1,5 @@
 #include "json-rpc/rpc_server.h"
+#include "json-rpc/rpc_coro.h"
 
 int Test(const nlohmann::json &, nlohmann::json &res)
 {
@@ -6,12 +7,54 @@ int Test(const nlohmann::json &, nlohmann::json &res)
     return 0;
 }
 
-int main()
+oolong::task<nlohmann::json> Sleep(const nlohmann::json &params)
+{
+    long ms = params.value("ms", 100);
+
+    // no worker is held meanwhile
+    co_await oolong::sleep_for(ms);
+
+    co_return nlohmann::json({ { "slept", ms } });
+}
+
+int main(int argc, char *argv[])
 {
     auto &s = oolong::JSONRPCServer::Instance();
 
+    auto backend = oolong::Reactor::LIBEVENT;
+
+    if (argc > 1 &&
+        oolong::Reactor::Parse(argv[1], &backend) < 0)
+    {
+        printf("%s [libevent|io_uring]\n", argv[0]);
+        return -1;
+    }
+
     s.BindTCP(8899);
 
-    s.AddMethod("test", Test);
-    s.StartListen();
+    s.AddMethod("test", "says it works", Test,
+                oolong::JSONRPCServer::METHOD_INLINE);
+
+    s.SetSchema("test",
+                { { "type", "object" } },
+                {
+                    { "type", "object" },
+                    { "properties", { { "data", { { "type", "string" } } } } },
+                });
+
+    oolong::AddCoMethod(s, "sleep", "waits params.ms millisec", Sleep);
+
+    s.SetSchema("sleep",
+                {
+                    { "type", "object" },
+                    { "properties",
+                        { { "ms", { { "type", "integer" }, { "minimum", 0 } } } }
+                    },
+                },
+                {
+                    { "type", "object" },
+                    { "properties", { { "slept", { { "type", "integer" } } } } },
+                });
+
+    s.StartListen(4, backend);
 }